@@ -6,22 +6,142 @@
  * launch arguments.
  * @usage:
  * ./sps [-d DELIM] 'command sequence' 'file' 
+ * ./sps [-d DELIM] -f 'script file' 'file'
+ * --mem-limit SIZE[K|M|G] before the file keeps only that much of the table
+ * in memory, the rest is read from the file when it is used
+ * --lazy parses rows only when they are used and saves the others unchanged
+ * --snapshot loads the table from FILE.spsnap if it is up to date and saves
+ * the edited table to it
+ * ./sps [-d DELIM] --serve SOCKET [--flush-every SECONDS] 'file'
+ * --serve keeps the table in memory and runs command sequences sent as lines
+ * to the Unix socket, a line starting with ? is a query, it can't change the
+ * table and gets the results of sum, avg, count and len and the selection it
+ * ends with, flush saves the table and quit saves it and stops the server,
+ * every line is answered with ok or error after the results
+ * --flush-every saves the changed table at most that many seconds after the
+ * first unsaved change
+ * ./sps [-d DELIM] --batch 'list' 'file'
+ * --batch runs every script file of the list on its own copy of the table and
+ * saves the result to the output file given after it on the same line, they
+ * are separated by a tab, the file itself isn't changed
+ * @build:
+ * gcc -std=c99 -Wall -Wextra -Werror -O2 -pthread sps.c -o sps
 ******************************************************************************/
 
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <math.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#define PARSE_OK 0
+#define PARSE_QUOTE 1
+#define PARSE_ALLOC 2
+#define PARSE_SYNTAX 3
+
+//upper limit of worker threads
+#define MAX_THREADS 64
+//inputs are split for parallel parsing into chunks at least this big
+#define PARSE_CHUNK_MIN (1 << 20)
+//collumns with at most DICT_MAX distinct texts in a chunk of the input keep
+//one shared cell for each text
+#define DICT_MAX 256
+
+//size of the output buffer, the table is written in blocks of this size
+#define OUT_BUF_SIZE (1 << 20)
+//rows formatted by one thread at a time when writing in parallel
+#define FORMAT_BATCH 16384
+
+//states of the cached numeric value of a cell
+#define NUM_UNKNOWN 0
+#define NUM_VALID 1
+#define NUM_INVALID 2
+//the cell holds a calculated number without text, its value as read back
+//from the text has to be rounded first
+#define NUM_EXACT 3
+//selections with fewer rows are reduced cell by cell instead of over
+//numeric columns
+#define COLUMN_MIN_ROWS 4096
+//selections are split into stripes of rows at multiples of STRIPE_ROWS for
+//the thread pool, a multiple of 64 so stripes never share a bitmap word
+#define STRIPE_ROWS 16384
+
+//enough for any number printed with %g
+#define NUM_TEXT_SIZE 32
+
+//buckets of the trigram index used by [find]
+#define INDEX_BITS 16
+#define INDEX_BUCKETS (1 << INDEX_BITS)
+//the index is built by the INDEX_FINDS-th [find] since the table changed shape
+#define INDEX_FINDS 2
+//cells without the string remembered by a [find] without the index
+#define FIND_MISSED 64
+
+//how deep foreach commands can be nested
+#define MAX_LOOPS 16
+//compiled scripts in the cache are only read by builds of the same version
+#define CACHE_VERSION 1
+#define PATH_SIZE 4096
+//scripts not run for CACHE_MAX_AGE seconds leave the cache, and the least
+//recently run ones leave it while it's bigger than CACHE_MAX_SIZE bytes
+#define CACHE_MAX_AGE (30 * 24 * 3600)
+#define CACHE_MAX_SIZE (16 * 1024 * 1024)
+//snapshots of tables are only read by builds of the same version
+#define SNAP_VERSION 1
+//clients connected to the server at once
+#define SERVE_CLIENTS 64
+//longest request line of a client
+#define REQUEST_MAX (1 << 24)
+//most recently used rows of a paged table that are never unloaded, callers
+//can hold a few rows at once
+#define PAGER_PINNED 16
+//selection ends given as _ or -, they are set to the table size once it is read
+#define SEL_LAST_ROW 1
+#define SEL_LAST_COL 2
 
-#define NOT_LAST_CELL 2
-#define LAST_CELL 3
-#define LAST_ROW 4
+//character classes for writing and reading cells
+#define CH_QUOTE 1
+#define CH_ESCAPE 2
+#define CH_DELIM 4
+#define CH_SPECIAL 8
 
-#define CELL(R, C) table->rows[R]->cells[C]->content
+//rows and cells are kept in gap buffers, all free slots form one gap starting
+//at gapStart, so logical index I lives in slot I before the gap and in slot
+//I + (allocLen - len) after it
+#define SLOT(I, buf) ((I) < (buf)->gapStart ? (I) : (I) + (buf)->allocLen - (buf)->len)
+//rows of a paged table are loaded when they are used, ROW_SLOT is the row
+//as it is, for storing rows and for code that handles stored rows itself
+#define ROW(R) (*(table->pager != NULL ? pageIn(table, SLOT(R, table)) : &table->rows[SLOT(R, table)]))
+#define ROW_SLOT(R) table->rows[SLOT(R, table)]
+#define ROW_LOADED(row) ((row)->page == NULL || (row)->page->loaded)
+//the slot of a cell stored in row, CELL also reads the empty cells past the
+//end of the row, they are only stored once they are written
+#define CELLP(row, C) (row)->cells[SLOT(C, row)]
+#define CELL(R, C) cellAt(ROW(R), C)
 
 enum commands{UNKNOWN, SELECTION, SELECTION_MAX, SELECTION_MIN, SELECTION_FIND,
 SELECTION_RESTORE, IROW, AROW, DROW, ICOL, ACOL, DCOL, SET_STR, CLEAR, SWAP,
-SUM, AVG, COUNT, LEN, DEF_TEMP, USE_TEMP, INC_TEMP, SET_TEMP, GOTO, ISZERO, SUB};
+SUM, AVG, COUNT, LEN, DEF_TEMP, USE_TEMP, INC_TEMP, SET_TEMP, GOTO, ISZERO, SUB,
+SELECTION_LOOKUP, FOREACH_ROWS, FOREACH_CELLS, END_EACH, FILTER,
+//instructions of compiled programs only, pairs of commands fused into one
+//and the ends of the program
+SEL_SET, SEL_CLEAR, SEL_USE, SEL_DEF, SUB_ISZERO, END, FAIL, OP_COUNT};
 
 typedef struct {
     int R1;
@@ -36,52 +156,621 @@ typedef struct {
     char* text;
 } tempVar_t;
 
+//cells are never changed once they are in the table, writing a cell stores
+//a new one, so one cell can fill any number of slots
 typedef struct {
+    //NULL if the cell holds a calculated number that wasn't printed yet
     char* content;
     int len;
-    int allocLen;
+    //number of slots holding the cell
+    int refs;
+    //the content parsed as a number, valid while numState is NUM_VALID
+    char numState;
+    //the text is known to be printed as it is, without quotes or escapes
+    bool plain;
+    double num;
 } cell_t;
 
+typedef struct rowPage rowPage_t;
+typedef struct pager pager_t;
+
 typedef struct {
     cell_t** cells;
     int len;
     int allocLen;
+    int gapStart;
+    //where the row of a paged table is stored, NULL for other tables
+    rowPage_t* page;
+    //text of the collumns after the ones the commands use, as it was read,
+    //those cells hold rawCell, NULL if the row has none
+    const char* tail;
+    int tailLen;
+    //last non empty cell of the text, counted from 1
+    int tailFull;
+    //the line of input the row was read from if it's formatted like the
+    //output and no cell of it was changed since, NULL otherwise
+    const char* text;
+    int textLen;
+    int textCells;
 } row_t;
 
+//numbers of one collumn stored contiguously for aggregating big selections
+typedef struct {
+    //value of every row, NaN if the cell isn't a number
+    double* num;
+    //bitmaps of rows holding a number and of rows that aren't empty
+    uint64_t* isNum;
+    uint64_t* nonEmpty;
+    //number of rows
+    int len;
+    //segment trees for [min] and [max], node i holds the winning row of the
+    //rows covered by nodes 2i and 2i+1, leaves start at len, NULL until used
+    int* minTree;
+    int* maxTree;
+} column_t;
+
+//cells listed by one bucket of the trigram index as pairs of row and collumn
+typedef struct {
+    int* cells;
+    int len;
+    int allocLen;
+} posting_t;
+
+//trigram index of cell texts for [find], a bucket lists every cell that held
+//a trigram hashed to it, cells that changed since are left in and filtered
+//out by checking the text
+typedef struct {
+    posting_t buckets[INDEX_BUCKETS];
+    //postings when the index was built and added by writes since
+    long built;
+    long added;
+} findIndex_t;
+
+//hash index of the texts of one collumn for [lookup], entries of a bucket
+//are chained through next, entries of rows written since the index was built
+//are added and the old ones are filtered out by comparing the text
+typedef struct {
+    //first entry of every bucket, -1 if there is none
+    int* heads;
+    int mask;
+    int* next;
+    int* rows;
+    int len;
+    int allocLen;
+    //entries when the index was built
+    int built;
+} lookup_t;
+
+//worker threads waiting for jobs from runParallel, started on first use
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    pthread_t threads[MAX_THREADS];
+    int threadsLen;
+    bool quit;
+    //the current batch of jobs, next is the first job nobody took yet
+    void* (*fn)(void*);
+    char* args;
+    size_t argSize;
+    int count;
+    int next;
+    int finished;
+    //run every job on the caller's thread
+    bool serial;
+} pool_t;
+
+//output buffer, flushed to fd when full, or growing if fd is -1
+typedef struct {
+    int fd;
+    char* buf;
+    int len;
+    int allocLen;
+} outBuf_t;
+
 typedef struct {
     row_t** rows;
     int len;
     int allocLen;
+    int gapStart;
+    bool ragged;
+    //number of collumns, rows can be shorter, the rest of their cells is empty
+    int width;
     char* delim;
     selection_t selection;
     selection_t tmpSelection;
     tempVar_t** vars;
+    //numeric collumns built on demand, they are dropped whenever rows or
+    //collumns move and kept in sync with writes otherwise
+    column_t** columns;
+    int columnsLen;
+    //trigram index for [find], NULL until enough of them are run, dropped
+    //like the numeric collumns
+    findIndex_t* findIndex;
+    int finds;
+    //hash indexes of collumns for [lookup], built on first use
+    lookup_t** lookups;
+    int lookupsLen;
+    //CH_ flags of every character for the current delim
+    unsigned char charClass[256];
+    pool_t pool;
+    //storage of the rows with --mem-limit, NULL if they are all in memory
+    pager_t* pager;
+    //collumns the commands can use, the others are kept as text, 0 if all
+    int keepCols;
+    //the input file, it stays mapped while rows are read from it
+    char* source;
+    size_t sourceLen;
+    //the snapshot the table was loaded from and its cells, NULL if it wasn't
+    char* snap;
+    size_t snapLen;
+    cell_t* snapCells;
+    //replies of a query run by the server, results of commands are written
+    //to it instead of the table, NULL otherwise
+    outBuf_t* reply;
 } table_t;
 
+typedef struct {
+    char* text;
+    int len;
+    int allocLen;
+} parseBuf_t;
+
+//a row of a paged table that isn't loaded is kept as text in the input file
+//or in the page file, the row stays in the table with its cells freed and
+//len still counting them
+struct rowPage {
+    row_t* row;
+    pager_t* pager;
+    //neighbours in the pager's list of loaded rows
+    rowPage_t* prev;
+    rowPage_t* next;
+    //the stored text, bytes is -1 if the row was never stored
+    off_t offset;
+    int bytes;
+    bool inPageFile;
+    //the text is formatted like the output, so it can be copied there as it is
+    bool verbatim;
+    //cells in the text and the last non empty one, counted from 1
+    int cells;
+    int lastFull;
+    bool loaded;
+    //estimated memory used by the loaded row
+    size_t size;
+};
+
+//storage of a table opened with --mem-limit, rows are parsed from their
+//stored text when they are used and the least recently used ones are
+//unloaded again once the loaded rows take more than limit bytes
+struct pager {
+    //the input file mapped into memory
+    const char* source;
+    //temporary file rows changed since they were read are appended to
+    int fd;
+    off_t fileLen;
+    //page file of the process the table was forked from, pages stored before
+    //forkLen are read from it, -1 if the table wasn't forked
+    int forkFd;
+    off_t forkLen;
+    //loaded rows from the most to the least recently used
+    rowPage_t* first;
+    rowPage_t* last;
+    int loaded;
+    size_t used;
+    size_t limit;
+    const unsigned char* charClass;
+    const char* delim;
+    int keepCols;
+    //rows that were never loaded are saved as their stored text even if it
+    //isn't formatted like the output
+    bool keepText;
+    //buffers for formatting, reading and parsing stored rows
+    outBuf_t out;
+    parseBuf_t text;
+    parseBuf_t buf;
+};
+
+typedef struct {
+    table_t* table;
+    outBuf_t out;
+    int R1;
+    int R2;
+    int err;
+} formatJob_t;
+
+typedef struct {
+    const char* begin;
+    const char* end;
+    const unsigned char* charClass;
+    //rows of a paged table are only measured
+    pager_t* pager;
+    int keepCols;
+    char delim;
+    row_t** rows;
+    int len;
+    int allocLen;
+    int err;
+} parseChunk_t;
+
+//distinct texts of one collumn of a chunk, open addressing over allocLen
+//slots, the cells aren't referenced by the dictionary itself
+typedef struct {
+    cell_t** cells;
+    int len;
+    int allocLen;
+    //more than DICT_MAX texts, the collumn isn't shared anymore
+    bool full;
+} dict_t;
+
+//part of a selection processed by one job of the thread pool
+typedef struct {
+    table_t* table;
+    //0-based rows R1 up to (not including) R2 and collumns C1 up to C2
+    int R1, R2, C1, C2;
+    //string to find
+    const char* str;
+    //cell to store
+    cell_t* cell;
+    bool minOrMax;
+    //sum or the best number
+    double num;
+    //rounding error of the sum that isn't in num yet
+    double comp;
+    //numbers, non empty cells or characters
+    int count;
+    //cell found in the stripe, R is -1 if there is none
+    int R, C;
+    int err;
+} stripe_t;
+
 typedef struct {
     int argc;
     char** argv;
 } args_t;
 
+//settings given by the launch arguments
+typedef struct {
+    char* fileName;
+    char* commands;
+    char* script;
+    //memory for the rows of a paged table, 0 if it isn't paged
+    size_t memLimit;
+    bool lazy;
+    bool snapshot;
+    //socket of the server, NULL if the commands are run once
+    char* serve;
+    //seconds after which changes of the server are saved, 0 if only on flush
+    int flushEvery;
+    //list of scripts and their outputs, NULL if there is none
+    char* batch;
+} options_t;
+
 typedef struct {
     int name;
     char* str;
     int var;
     int var2;
     selection_t selection;
+    //SEL_LAST_ flags of the selection, the ends are set by resolveSelections
+    int ends;
 } command_t;
 
+//growing array of parsed commands
+typedef struct {
+    command_t* cmds;
+    int len;
+    int allocLen;
+} cmdList_t;
+
+//header of a compiled script in the cache, followed by the script itself,
+//so scripts with the same hash can't be mistaken for each other, and count
+//commands
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t opCount;
+    int32_t count;
+    //hash and size of the script
+    uint64_t hash;
+    uint64_t size;
+} cacheHeader_t;
+
+//header of a snapshot of the table in FILE.spsnap, followed by the rows, the
+//numbers of cells that were parsed and the heap with the text of all cells
+//in order, each ending with 0
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    //size and modification time of the file the snapshot belongs to
+    uint64_t size;
+    int64_t mtime, mtimeNsec;
+    //hash of the delim, lines of the file are only copied with the same one
+    uint64_t delimHash;
+    int64_t rows, cells, nums, heapLen;
+} snapHeader_t;
+
+//row of a snapshot
+typedef struct {
+    //line of the row in the file if it's formatted like the output, -1 if not
+    int64_t offset;
+    //text of the first cell of the row in the heap
+    int64_t heap;
+    int32_t textLen, textCells;
+    int32_t cells, unused;
+} snapRow_t;
+
+//cell of a snapshot holding a number, counted over all rows
+typedef struct {
+    int64_t cell;
+    double num;
+} snapNum_t;
+
+//rows R1 up to (not including) R2 of a snapshot made into rows of the table
+//by one thread, their cells start at firstCell of the block
+typedef struct {
+    table_t* table;
+    const snapHeader_t* header;
+    const snapRow_t* rows;
+    const char* heap;
+    const char* source;
+    cell_t* block;
+    int R1, R2;
+    int64_t firstCell;
+    //rows made so far start at R1
+    int made;
+    bool err;
+} snapJob_t;
+
+//command in the cache, followed by strLen characters of its string
+typedef struct {
+    int32_t name, var, var2, ends;
+    int32_t R1, C1, R2, C2;
+    //-1 if the command has no string
+    int32_t strLen;
+} cacheCmd_t;
+
+//file in the cache directory
+typedef struct {
+    char name[32];
+    time_t mtime;
+    off_t size;
+} cacheFile_t;
+
+//predicates of filter, in the order of filterOps
+enum filters{FILTER_EQ, FILTER_NE, FILTER_HAS, FILTER_LT, FILTER_GT, FILTER_COUNT};
+const char* filterOps[FILTER_COUNT] = {"=", "!=", "~", "<", ">"};
+
+//state of a running foreach, selection is restored when it ends
+typedef struct {
+    selection_t selection;
+    bool cells;
+    //current row and cell, the first cell of a row and the last ones in the
+    //table, rows and collumns inserted or deleted by the body move them
+    int R, C;
+    int C1;
+    int R2, C2;
+} loop_t;
+
+//compiled command, what the operands mean depends on op
+typedef struct {
+    unsigned char op;
+    unsigned char var;
+    unsigned char var2;
+    //jump target, count or index of a selection, string or cell of the program
+    int arg;
+    int arg2;
+} instr_t;
+
+//commands compiled to instructions with jumps resolved to instruction indexes,
+//operands too big for an instruction are kept in side arrays
+typedef struct {
+    instr_t* code;
+    int len;
+    selection_t* sels;
+    int selsLen;
+    //strings to find and cells to set, they are shared with the commands
+    const char** strs;
+    cell_t** cells;
+    int strsLen;
+} program_t;
+
+//the empty cell shared by all empty slots, it is never freed
+cell_t emptyCell = {"", 1, 1, NUM_INVALID, true, 0};
+//cell of the collumns kept as text in the tail of their row
+cell_t rawCell = {"", 1, 1, NUM_INVALID, false, 0};
+
+//returns cell C of row, the cells past its end are empty
+cell_t* cellAt(row_t* row, int C){
+    return C < row->len ? CELLP(row, C) : &emptyCell;
+}
+
+//cells of one line of input counted without saving them
+typedef struct {
+    int cells;
+    //last non empty cell, counted from 1
+    int lastFull;
+    //formatted like the output
+    bool verbatim;
+    //ends with a backslash escaping the newline
+    bool escapedEnd;
+} lineInfo_t;
+
+//a client of the server and the part of its request it didn't send yet
+typedef struct {
+    int fd;
+    parseBuf_t in;
+} client_t;
+
+//one script of --batch and the file its result is saved to
+typedef struct {
+    char* script;
+    char* output;
+    command_t* cmds;
+    int cmdCount;
+    //process running the script, 0 if it isn't running
+    pid_t pid;
+} batchJob_t;
+
+row_t** pageIn(table_t* table, int slot);
+const char* parseRow(const char* p, const char* end, row_t* row,
+    const unsigned char* charClass, parseBuf_t* buf, int* err, int keep, char delim);
+const char* measureLine(const char* p, const char* end, const unsigned char* charClass,
+    char delim, lineInfo_t* info);
+
+//adds a reference to cell for one more slot or holder
+void refCell(cell_t* cell){
+    if(cell != &emptyCell && cell != &rawCell) cell->refs++;
+}
+
+//drops one slot's reference to cell and frees it when it was the last one,
+//stripes can drop references to the same cell at once
+void unrefCell(cell_t* cell){
+    if(cell == &emptyCell || cell == &rawCell) return;
+    if(__atomic_sub_fetch(&cell->refs, 1, __ATOMIC_ACQ_REL) == 0){
+        free(cell->content);
+        free(cell);
+    }
+}
+
+//free all cells in row from position C1 up to (not including) C2
+void freeCells(row_t* row, int C1, int C2){
+    for(int j = C1; j < C2; j++){
+        unrefCell(CELLP(row, j));
+    }
+}
+
+//removes a loaded row from the pager's list
+void unlinkPage(rowPage_t* page){
+    pager_t* pager = page->pager;
+    if(page->prev != NULL) page->prev->next = page->next;
+    else pager->first = page->next;
+    if(page->next != NULL) page->next->prev = page->prev;
+    else pager->last = page->prev;
+    page->prev = NULL;
+    page->next = NULL;
+    pager->loaded--;
+    pager->used -= page->size;
+}
+
+//adds a loaded row to the front of the pager's list
+void pushPage(rowPage_t* page){
+    pager_t* pager = page->pager;
+    page->prev = NULL;
+    page->next = pager->first;
+    if(pager->first != NULL) pager->first->prev = page;
+    else pager->last = page;
+    pager->first = page;
+    pager->loaded++;
+    pager->used += page->size;
+}
+
+//free a row and all of its cells
+void freeRow(row_t* row){
+    rowPage_t* page = row->page;
+    //cells of a stored row were freed when it was unloaded
+    if(page == NULL || page->loaded) freeCells(row, 0, row->len);
+    if(page != NULL){
+        if(page->loaded) unlinkPage(page);
+        free(page);
+    }
+    free(row->cells);
+    free(row);
+}
+
+//free a numeric column
+void freeColumn(column_t* column){
+    free(column->minTree);
+    free(column->maxTree);
+    free(column->num);
+    free(column->isNum);
+    free(column->nonEmpty);
+    free(column);
+}
+
+//free all numeric columns, they are rebuilt when needed again
+void dropColumns(table_t* table){
+    for(int i = 0; i < table->columnsLen; i++){
+        if(table->columns[i] != NULL) freeColumn(table->columns[i]);
+    }
+    free(table->columns);
+    table->columns = NULL;
+    table->columnsLen = 0;
+}
+
+//free the trigram index, it is rebuilt when [find] is used enough again
+void dropFindIndex(table_t* table){
+    if(table->findIndex != NULL){
+        for(int i = 0; i < INDEX_BUCKETS; i++) free(table->findIndex->buckets[i].cells);
+        free(table->findIndex);
+        table->findIndex = NULL;
+    }
+    table->finds = 0;
+}
+
+//free a collumn's hash index
+void freeLookup(lookup_t* lookup){
+    free(lookup->heads);
+    free(lookup->next);
+    free(lookup->rows);
+    free(lookup);
+}
+
+//free the hash indexes of all collumns
+void dropLookups(table_t* table){
+    for(int i = 0; i < table->lookupsLen; i++){
+        if(table->lookups[i] != NULL) freeLookup(table->lookups[i]);
+    }
+    free(table->lookups);
+    table->lookups = NULL;
+    table->lookupsLen = 0;
+}
+
+//free everything derived from cell positions, called whenever rows or
+//collumns move
+void dropIndexes(table_t* table){
+    dropColumns(table);
+    dropFindIndex(table);
+    dropLookups(table);
+}
+
+//stops and joins the pool's threads
+void freePool(pool_t* pool){
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for(int i = 0; i < pool->threadsLen; i++){
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->done);
+}
+
+//frees the pager and unmaps the input file
+void freePager(pager_t* pager){
+    if(pager == NULL) return;
+    if(pager->fd >= 0) close(pager->fd);
+    if(pager->forkFd >= 0) close(pager->forkFd);
+    free(pager->out.buf);
+    free(pager->text.text);
+    free(pager->buf.text);
+    free(pager);
+}
+
 //free all memory used in table
 void freeTable(table_t* table){
+    freePool(&table->pool);
+    dropIndexes(table);
     for(int i = 0; i < table->len; i++){
-        for(int j = 0; j < table->rows[i]->len; j++){
-            free(table->rows[i]->cells[j]->content);
-            free(table->rows[i]->cells[j]);
-        }
-        free(table->rows[i]->cells);
-        free(table->rows[i]);
+        freeRow(ROW_SLOT(i));
     }
     free(table->rows);
+    freePager(table->pager);
+    if(table->source != NULL) munmap(table->source, table->sourceLen);
+    //cells of the snapshot are never freed by the rows
+    free(table->snapCells);
+    if(table->snap != NULL) munmap(table->snap, table->snapLen);
     free(table->delim);
 
     //10 temporary variables
@@ -100,83 +789,465 @@ void freeCmds(command_t* cmds, int cmdCount){
     free(cmds);
 }
 
-//checks if char is in delim
-bool isDelim(char c, char* delim){
-    int delimCount = strlen(delim);
-    for(int i = 0; i < delimCount; i++){
-        if(c == delim[i]){
-            return true;
+//returns the text of cell, calculated numbers are printed into tmp of at
+//least NUM_TEXT_SIZE chars
+const char* cellText(cell_t* cell, char* tmp){
+    if(cell->content != NULL) return cell->content;
+    snprintf(tmp, NUM_TEXT_SIZE, "%g", cell->num);
+    return tmp;
+}
+
+//checks if cell has no content
+bool cellEmpty(cell_t* cell){
+    return cell->content != NULL && cell->content[0] == 0;
+}
+
+//saves the number in cell to out, returns EXIT_SUCCESS if the cell contains
+//only a number, the result is cached until the cell is written
+int cellNum(cell_t* cell, double* out){
+    if(cell->numState == NUM_UNKNOWN){
+        char* endptr;
+        cell->num = strtod(cell->content, &endptr);
+        cell->numState = cell->content[0] != 0 && endptr[0] == 0 ? NUM_VALID : NUM_INVALID;
+    }
+    else if(cell->numState == NUM_EXACT){
+        //the number is read back the same way as if it was saved as text
+        char tmp[NUM_TEXT_SIZE];
+        snprintf(tmp, NUM_TEXT_SIZE, "%g", cell->num);
+        cell->num = strtod(tmp, NULL);
+        cell->numState = NUM_VALID;
+    }
+    if(cell->numState == NUM_INVALID) return EXIT_FAILURE;
+    *out = cell->num;
+    return EXIT_SUCCESS;
+}
+
+//returns the FNV-1a hash of text
+uint32_t hashText(const char* text){
+    uint32_t hash = 2166136261u;
+    for(; *text; text++) hash = (hash ^ (unsigned char)*text) * 16777619u;
+    return hash;
+}
+
+//returns the number of threads to use, SPS_THREADS overrides the number of
+//online processors
+int threadCount(){
+    char* env = getenv("SPS_THREADS");
+    long count = env != NULL ? strtol(env, NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+    if(count < 1) return 1;
+    if(count > MAX_THREADS) return MAX_THREADS;
+    return count;
+}
+
+//initializes a pool without threads, they are started by the first runParallel
+void initPool(pool_t* pool){
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->threadsLen = 0;
+    pool->quit = false;
+    pool->count = 0;
+    pool->next = 0;
+    pool->finished = 0;
+    pool->serial = false;
+}
+
+//runs jobs of the current batch until nobody is left to take, the pool has
+//to be locked
+void runJobs(pool_t* pool){
+    while(pool->next < pool->count){
+        void* (*fn)(void*) = pool->fn;
+        void* arg = pool->args + pool->next++ * pool->argSize;
+        pthread_mutex_unlock(&pool->lock);
+        fn(arg);
+        pthread_mutex_lock(&pool->lock);
+        if(++pool->finished == pool->count) pthread_cond_broadcast(&pool->done);
+    }
+}
+
+//main loop of a pool thread
+void* poolWorker(void* arg){
+    pool_t* pool = arg;
+    pthread_mutex_lock(&pool->lock);
+    while(!pool->quit){
+        runJobs(pool);
+        if(!pool->quit) pthread_cond_wait(&pool->work, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+//runs fn on each of count arguments stored in args on the pool's threads,
+//the caller's thread takes jobs too and returns once all of them are done,
+//fn must not call runParallel itself
+void runParallel(pool_t* pool, void* (*fn)(void*), void* args, size_t argSize, int count){
+    if(count == 1 || pool->serial){
+        for(int i = 0; i < count; i++) fn((char*)args + i * argSize);
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    //if a thread can't be started, the others (or the caller) do its work
+    while(pool->threadsLen < threadCount() - 1){
+        if(pthread_create(&pool->threads[pool->threadsLen], NULL, poolWorker, pool)) break;
+        pool->threadsLen++;
+    }
+    pool->fn = fn;
+    pool->args = args;
+    pool->argSize = argSize;
+    pool->count = count;
+    pool->next = 0;
+    pool->finished = 0;
+    pthread_cond_broadcast(&pool->work);
+    runJobs(pool);
+    while(pool->finished < pool->count) pthread_cond_wait(&pool->done, &pool->lock);
+    pool->count = 0;
+    pool->next = 0;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+//builds the character classes used to decide on quoting and escaping
+void buildCharClass(table_t* table){
+    memset(table->charClass, 0, sizeof(table->charClass));
+    for(int i = 0; table->delim[i]; i++){
+        table->charClass[(unsigned char)table->delim[i]] |= CH_QUOTE | CH_DELIM;
+    }
+    table->charClass['"'] |= CH_QUOTE | CH_ESCAPE | CH_SPECIAL;
+    table->charClass['\\'] |= CH_ESCAPE | CH_SPECIAL;
+    table->charClass['\n'] |= CH_SPECIAL;
+}
+
+//reads len bytes at offset of fd
+int readAll(int fd, char* bytes, int len, off_t offset){
+    int done = 0;
+    while(done < len){
+        ssize_t rslt = pread(fd, bytes + done, len - done, offset + done);
+        if(rslt < 0 && errno == EINTR) continue;
+        if(rslt <= 0) return EXIT_FAILURE;
+        done += rslt;
+    }
+    return EXIT_SUCCESS;
+}
+
+//writes all len bytes to fd
+int writeAll(int fd, const char* bytes, int len){
+    int written = 0;
+    while(written < len){
+        ssize_t rslt = write(fd, bytes + written, len - written);
+        if(rslt < 0){
+            if(errno == EINTR) continue;
+            return EXIT_FAILURE;
         }
+        written += rslt;
     }
-    return false;
+    return EXIT_SUCCESS;
 }
 
-//prints the table to file with correct formatting
-void printTable(table_t* table, FILE* file){
-    for(int i = 0; i < table->len; i++){
-        for(int j = 0; j < table->rows[i]->len; j++){
-            int len = strlen(CELL(i,j));
-            bool printQuotes = false;
-            for(int k = 0; k < len; k++){
-                if(isDelim(CELL(i,j)[k], table->delim) || CELL(i,j)[k] == '"')
-                    printQuotes = true;
-            }
-            if(printQuotes)
-                fprintf(file, "\"");
+//writes out everything in the output buffer
+int flushOut(outBuf_t* out){
+    if(writeAll(out->fd, out->buf, out->len)) return EXIT_FAILURE;
+    out->len = 0;
+    return EXIT_SUCCESS;
+}
+
+//copies len bytes into the output buffer, flushing it or growing it when full
+int putBytes(outBuf_t* out, const char* bytes, int len){
+    if(len == 0) return EXIT_SUCCESS;
+    if(out->len + len > out->allocLen && out->fd < 0){
+        int newAllocLen = out->allocLen == 0 ? OUT_BUF_SIZE : out->allocLen;
+        while(newAllocLen < out->len + len) newAllocLen *= 2;
+        char* newBuf = realloc(out->buf, newAllocLen);
+        if(newBuf == NULL) return EXIT_FAILURE;
+        out->buf = newBuf;
+        out->allocLen = newAllocLen;
+    }
+    else if(out->len + len > out->allocLen){
+        if(flushOut(out)) return EXIT_FAILURE;
+        //too big for the buffer, write it directly
+        if(len > out->allocLen){
+            return writeAll(out->fd, bytes, len);
+        }
+    }
+    memcpy(out->buf + out->len, bytes, len);
+    out->len += len;
+    return EXIT_SUCCESS;
+}
+
+//writes one cell, quoted if it contains delim or quotes, with escaped
+//backslashes and quotes
+int putCell(outBuf_t* out, const char* text, const unsigned char* charClass){
+    int len = 0;
+    unsigned char flags = 0;
+    while(text[len]){
+        flags |= charClass[(unsigned char)text[len]];
+        len++;
+    }
+    flags &= CH_QUOTE | CH_ESCAPE;
+    //most cells need no special treatment and are copied as they are
+    if(!flags) return putBytes(out, text, len);
+
+    if((flags & CH_QUOTE) && putBytes(out, "\"", 1)) return EXIT_FAILURE;
+    int start = 0;
+    for(int k = 0; k < len; k++){
+        if(charClass[(unsigned char)text[k]] & CH_ESCAPE){
+            //copy the run before the escaped character in one go
+            if(putBytes(out, &text[start], k - start) || putBytes(out, "\\", 1))
+                return EXIT_FAILURE;
+            start = k;
+        }
+    }
+    if(putBytes(out, &text[start], len - start)) return EXIT_FAILURE;
+    if((flags & CH_QUOTE) && putBytes(out, "\"", 1)) return EXIT_FAILURE;
+    return EXIT_SUCCESS;
+}
+
+//writes count delims into out, runs of empty cells are written in blocks
+int putDelims(outBuf_t* out, const char* delim, int count){
+    char run[64];
+    memset(run, delim[0], sizeof(run));
+    for(; count > 0; count -= sizeof(run)){
+        if(putBytes(out, run, count < (int)sizeof(run) ? count : (int)sizeof(run))) return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+//formats the cells of row into out, separated by the first character of delim,
+//the empty cells after the row up to width collumns are added as delims
+int putRow(outBuf_t* out, row_t* row, int width, const char* delim, const unsigned char* charClass){
+    for(int j = 0; j < row->len; j++){
+        char tmp[NUM_TEXT_SIZE];
+        cell_t* cell = CELLP(row, j);
+        if(cell == &rawCell){
+            //collumns kept as text are written as they were read
+            if(putBytes(out, row->tail, row->tailLen)) return EXIT_FAILURE;
+            while(j + 1 < row->len && CELLP(row, j + 1) == &rawCell) j++;
+        }
+        else if(cell->plain){
+            //shared cells were checked when they were read
+            if(putBytes(out, cell->content, cell->len - 1)) return EXIT_FAILURE;
+        }
+        else if(putCell(out, cellText(cell, tmp), charClass)){
+            return EXIT_FAILURE;
+        }
+        if(j != row->len - 1 && putBytes(out, delim, 1)){
+            return EXIT_FAILURE;
+        }
+    }
+    //a row without cells is one empty cell
+    return putDelims(out, delim, width - (row->len > 0 ? row->len : 1));
+}
+
+//returns the stored text of a paged row, NULL if it can't be read
+const char* storedText(pager_t* pager, rowPage_t* page){
+    if(!page->inPageFile) return pager->source + page->offset;
+    //a row emptied by the commands is stored as no text
+    if(page->bytes == 0) return "";
+    if(pager->text.allocLen < page->bytes){
+        char* newText = realloc(pager->text.text, page->bytes);
+        if(newText == NULL) return NULL;
+        pager->text.text = newText;
+        pager->text.allocLen = page->bytes;
+    }
+    //pages written before a fork are in the page file of the parent
+    bool forked = page->offset < pager->forkLen;
+    if(readAll(forked ? pager->forkFd : pager->fd, pager->text.text, page->bytes,
+        forked ? page->offset : page->offset - pager->forkLen)) return NULL;
+    return pager->text.text;
+}
+
+//checks if a stored row can be saved as its stored text, with empty cells
+//up to width collumns added after it
+bool storedCopyable(pager_t* pager, row_t* row, int width){
+    rowPage_t* page = row->page;
+    //cells cut off by trimming are in the text
+    if(page->cells > row->len) return false;
+    if(page->verbatim) return true;
+    if(!pager->keepText) return false;
+    //a delim added after a backslash would be escaped by it
+    return page->cells >= width || page->bytes == 0 ||
+        pager->source[page->offset + page->bytes - 1] != '\\';
+}
+
+//copies the stored text of a paged row into out, with empty cells up to
+//width collumns
+int putStored(pager_t* pager, outBuf_t* out, row_t* row, int width){
+    const char* text = storedText(pager, row->page);
+    if(text == NULL || putBytes(out, text, row->page->bytes)) return EXIT_FAILURE;
+    //empty text is one empty cell
+    return putDelims(out, pager->delim, width - (row->page->cells > 0 ? row->page->cells : 1));
+}
 
-            for(int k = 0; k < len; k++){
-                if(CELL(i,j)[k] == '\\' || CELL(i,j)[k] == '"')
-                    fprintf(file, "\\");
-                fprintf(file, "%c", CELL(i,j)[k]);
+//formats rows R1 up to (not including) R2 into out
+int putRows(table_t* table, outBuf_t* out, int R1, int R2){
+    for(int i = R1; i < R2; i++){
+        row_t* row = ROW_SLOT(i);
+        //stored rows are copied as they are when possible
+        if(!ROW_LOADED(row) && storedCopyable(table->pager, row, table->width)){
+            if(putStored(table->pager, out, row, table->width)) return EXIT_FAILURE;
+        }
+        else if(row->text != NULL){
+            //unchanged rows following each other in the input are copied at once
+            const char* text = row->text;
+            int len = row->textLen;
+            while(row->textCells >= table->width && i + 1 < R2){
+                row_t* next = ROW_SLOT(i + 1);
+                if(!ROW_LOADED(next) || next->text != text + len + 1) break;
+                len += next->textLen + 1;
+                row = next;
+                i++;
+            }
+            //empty cells after the text
+            if(putBytes(out, text, len) || putDelims(out, table->delim, table->width - row->textCells)){
+                return EXIT_FAILURE;
             }
-        
-            if(printQuotes)
-                fprintf(file, "\"");
+        }
+        else if(putRow(out, ROW(i), table->width, table->delim, table->charClass)){
+            return EXIT_FAILURE;
+        }
+        if(putBytes(out, "\n", 1)){
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
 
-            if(j != table->rows[i]->len - 1){
-                fprintf(file, "%c", table->delim[0]);
+//formats one batch of rows into its own buffer
+void* formatBatch(void* arg){
+    formatJob_t* job = arg;
+    job->out.len = 0;
+    job->err = putRows(job->table, &job->out, job->R1, job->R2);
+    return NULL;
+}
+
+//prints the table to file with correct formatting, big tables are formatted
+//in parallel batches that are written in order
+int printTable(table_t* table, FILE* file){
+    int fd = fileno(file);
+    int count = threadCount();
+    if(count > table->len / FORMAT_BATCH) count = table->len / FORMAT_BATCH;
+    //rows of a paged table can only be loaded by one thread
+    if(table->pager != NULL) count = 1;
+
+    int err = EXIT_SUCCESS;
+    if(count <= 1){
+        outBuf_t out = {fd, malloc(OUT_BUF_SIZE), 0, OUT_BUF_SIZE};
+        if(out.buf == NULL){
+            fprintf(stderr, "Memory allocation failure\n");
+            return EXIT_FAILURE;
+        }
+        err = putRows(table, &out, 0, table->len) || flushOut(&out);
+        free(out.buf);
+    }
+    else{
+        formatJob_t jobs[MAX_THREADS];
+        for(int i = 0; i < count; i++){
+            formatJob_t job = {table, {-1, NULL, 0, 0}, 0, 0, EXIT_SUCCESS};
+            jobs[i] = job;
+        }
+        //every round formats count batches at once and writes them in order
+        for(int R = 0; R < table->len && !err; R += count * FORMAT_BATCH){
+            for(int i = 0; i < count; i++){
+                jobs[i].R1 = R + i * FORMAT_BATCH;
+                if(jobs[i].R1 > table->len) jobs[i].R1 = table->len;
+                jobs[i].R2 = jobs[i].R1 + FORMAT_BATCH;
+                if(jobs[i].R2 > table->len) jobs[i].R2 = table->len;
+            }
+            runParallel(&table->pool, formatBatch, jobs, sizeof(formatJob_t), count);
+            for(int i = 0; i < count && !err; i++){
+                err = jobs[i].err || writeAll(fd, jobs[i].out.buf, jobs[i].out.len);
             }
         }
-        fprintf(file, "\n");
+        for(int i = 0; i < count; i++){
+            free(jobs[i].out.buf);
+        }
+    }
+
+    if(err){
+        fprintf(stderr, "Error while writing file\n");
+        return EXIT_FAILURE;
     }
+    return EXIT_SUCCESS;
 } 
 
-//Check the argument count and save correct delim, file name and commands strings
-int getArgs(args_t args, char** delim, char** fileName, char** commands){
+//parses a size in bytes with an optional K, M or G suffix
+int parseSize(const char* text, size_t* size){
+    char* endptr;
+    unsigned long long value = strtoull(text, &endptr, 10);
+    int shift = 0;
+    if(*endptr == 'K') shift = 10;
+    else if(*endptr == 'M') shift = 20;
+    else if(*endptr == 'G') shift = 30;
+    if(shift > 0) endptr++;
+    if(endptr == text || *endptr != 0 || value == 0 || value > (SIZE_MAX >> shift)) return EXIT_FAILURE;
+    *size = value << shift;
+    return EXIT_SUCCESS;
+}
+
+//Check the arguments and save delim and the other options, the options come
+//first and the file is always the last argument
+int getArgs(args_t args, char** delim, options_t* opts){
     if(args.argc < 3){
         fprintf(stderr, "Wrong number of arguments\n");
         return EXIT_FAILURE;
     }
 
-    //Delim is set, there must be 5 arguments
-    if(!strcmp(args.argv[1], "-d") && args.argc == 5){
-        *delim = malloc(strlen(args.argv[2]) * sizeof(char) + 1);
-        if(*delim == NULL){
-            fprintf(stderr, "Argument memory allocation failed\n");
+    char* delimArg = " ";
+    int i = 1;
+    while(i < args.argc - 1){
+        char* opt = args.argv[i];
+        if(!strcmp(opt, "--lazy") || !strcmp(opt, "--snapshot")){
+            if(!strcmp(opt, "--lazy")) opts->lazy = true;
+            else opts->snapshot = true;
+            i++;
+            continue;
+        }
+        if(strcmp(opt, "-d") && strcmp(opt, "-f") && strcmp(opt, "--mem-limit") &&
+            strcmp(opt, "--serve") && strcmp(opt, "--flush-every") && strcmp(opt, "--batch")) break;
+        //an option without a value
+        if(i + 1 >= args.argc - 1){
+            fprintf(stderr, "Wrong number of arguments\n");
             return EXIT_FAILURE;
         }
-        strcpy(*delim, args.argv[2]);
-        *fileName = args.argv[4];
-        *commands = args.argv[3];
-        return EXIT_SUCCESS;
-    }
-    //delim isn't set, there must be 3 arguments
-    else if(strcmp(args.argv[1], "-d") && args.argc == 3){
-        *delim = malloc(sizeof(char) * 2);
-        if(*delim == NULL){
-            fprintf(stderr, "Argument memory allocation failed\n");
+        if(!strcmp(opt, "-d")) delimArg = args.argv[i + 1];
+        else if(!strcmp(opt, "-f")) opts->script = args.argv[i + 1];
+        else if(!strcmp(opt, "--serve")) opts->serve = args.argv[i + 1];
+        else if(!strcmp(opt, "--batch")) opts->batch = args.argv[i + 1];
+        else if(!strcmp(opt, "--flush-every")){
+            char* endptr;
+            long seconds = strtol(args.argv[i + 1], &endptr, 10);
+            if(endptr == args.argv[i + 1] || *endptr != 0 || seconds < 1 || seconds > 86400){
+                fprintf(stderr, "Invalid flush interval\n");
+                return EXIT_FAILURE;
+            }
+            opts->flushEvery = seconds;
+        }
+        else if(parseSize(args.argv[i + 1], &opts->memLimit)){
+            fprintf(stderr, "Invalid memory limit\n");
             return EXIT_FAILURE;
         }
-        strcpy(*delim, " ");
-        *fileName = args.argv[2];
-        *commands = args.argv[1];
-        return EXIT_SUCCESS;
+        i += 2;
     }
-    //Not 3 or 5 arguments
-    else{
+    //the command sequence is only given without a script, the server gets
+    //its commands from the socket and a batch from its list
+    if((opts->script != NULL) + (opts->serve != NULL) + (opts->batch != NULL) > 1){
         fprintf(stderr, "Wrong number of arguments\n");
         return EXIT_FAILURE;
     }
+    if(opts->script == NULL && opts->serve == NULL && opts->batch == NULL){
+        opts->commands = args.argv[i++];
+    }
+    if(i != args.argc - 1){
+        fprintf(stderr, "Wrong number of arguments\n");
+        return EXIT_FAILURE;
+    }
+    opts->fileName = args.argv[i];
+
+    *delim = malloc(strlen(delimArg) * sizeof(char) + 1);
+    if(*delim == NULL){
+        fprintf(stderr, "Argument memory allocation failed\n");
+        return EXIT_FAILURE;
+    }
+    strcpy(*delim, delimArg);
+    return EXIT_SUCCESS;
 }
 
 //check if delim has \ or "
@@ -198,26 +1269,20 @@ row_t* row_ctor(){
 
     row->len = 0;
     row->allocLen = 0;
+    row->gapStart = 0;
     row->cells = NULL;
+    row->page = NULL;
+    row->tail = NULL;
+    row->tailLen = 0;
+    row->tailFull = 0;
+    row->text = NULL;
 
     return row;
 }
 
+//returns an empty cell, all of them share emptyCell
 cell_t* cell_ctor(){
-    cell_t* cell = malloc(sizeof(cell_t));
-    if(cell == NULL){
-        return NULL;
-    }
-
-    cell->len = 0;
-    cell->allocLen = 20;
-    cell->content = calloc(cell->allocLen, sizeof(char));
-    if(cell->content == NULL){
-        free(cell);
-        return NULL;
-    }
-
-    return cell;
+    return &emptyCell;
 }
 
 tempVar_t* var_ctor(){
@@ -243,187 +1308,293 @@ tempVar_t** init_vars(){
     return vars;
 }
 
-//appends a new row to the table
-int add_row(table_t* table){
-    row_t** newRows = table->rows;
-    if(table->len + 1 >= table->allocLen){
-        if(table->allocLen == 0) table->allocLen = 10;
-        table->allocLen *= 2;
-        newRows = realloc(table->rows, table->allocLen * sizeof(row_t*));
-        if(newRows == NULL){
-            return EXIT_FAILURE;
-        }
+//moves the gap of a gap buffer holding len items in allocLen slots so it
+//starts at logical position pos
+void moveGap(void* items, size_t size, int len, int allocLen, int* gapStart, int pos){
+    char* base = items;
+    int gapLen = allocLen - len;
+    if(pos < *gapStart){
+        memmove(base + (pos + gapLen) * size, base + pos * size, (*gapStart - pos) * size);
     }
-    
-    newRows[table->len] = row_ctor();
-    if(newRows[table->len] == NULL){
-        free(newRows);
-        return EXIT_FAILURE;
+    else if(pos > *gapStart){
+        memmove(base + *gapStart * size, base + (*gapStart + gapLen) * size, (pos - *gapStart) * size);
     }
-    table->len++;
+    *gapStart = pos;
+}
+
+//makes room for count more items in a gap buffer by doubling its size,
+//returns the reallocated items or NULL on failure
+void* growGap(void* items, size_t size, int len, int* allocLen, int gapStart, int count){
+    if(len + count <= *allocLen) return items;
+    int newAllocLen = *allocLen == 0 ? 20 : *allocLen * 2;
+    while(newAllocLen < len + count) newAllocLen *= 2;
+    char* newItems = realloc(items, newAllocLen * size);
+    if(newItems == NULL) return NULL;
+
+    //items after the gap belong at the end of the bigger block
+    int after = len - gapStart;
+    memmove(newItems + (newAllocLen - after) * size, newItems + (*allocLen - after) * size, after * size);
+    *allocLen = newAllocLen;
+    return newItems;
+}
+
+//halves the allocated size of a gap buffer once it is less than a quarter
+//full, so deleting items one by one doesn't realloc on every call
+void* shrinkGap(void* items, size_t size, int len, int* allocLen, int* gapStart){
+    if(*allocLen <= 20 || len >= *allocLen / 4) return items;
+    moveGap(items, size, len, *allocLen, gapStart, len);
+    void* newItems = realloc(items, (*allocLen / 2) * size);
+    //keeping the bigger block is harmless if realloc fails
+    if(newItems == NULL) return items;
+    *allocLen /= 2;
+    return newItems;
+}
+
+//opens count empty slots before row R, the caller has to fill them
+int openRows(table_t* table, int R, int count){
+    if(count == 0) return EXIT_SUCCESS;
+    dropIndexes(table);
+    row_t** newRows = growGap(table->rows, sizeof(row_t*), table->len, &table->allocLen, table->gapStart, count);
+    if(newRows == NULL) return EXIT_FAILURE;
     table->rows = newRows;
+    moveGap(table->rows, sizeof(row_t*), table->len, table->allocLen, &table->gapStart, R);
+    table->gapStart += count;
+    table->len += count;
+    return EXIT_SUCCESS;
+}
+
+//removes count row slots starting at row R, the rows have to be freed already
+void closeRows(table_t* table, int R, int count){
+    dropIndexes(table);
+    moveGap(table->rows, sizeof(row_t*), table->len, table->allocLen, &table->gapStart, R);
+    table->len -= count;
+    table->rows = shrinkGap(table->rows, sizeof(row_t*), table->len, &table->allocLen, &table->gapStart);
+}
 
+//opens count empty slots before cell C, the caller has to fill them
+int openCells(row_t* row, int C, int count){
+    if(count == 0) return EXIT_SUCCESS;
+    cell_t** newCells = growGap(row->cells, sizeof(cell_t*), row->len, &row->allocLen, row->gapStart, count);
+    if(newCells == NULL) return EXIT_FAILURE;
+    row->cells = newCells;
+    moveGap(row->cells, sizeof(cell_t*), row->len, row->allocLen, &row->gapStart, C);
+    row->gapStart += count;
+    row->len += count;
     return EXIT_SUCCESS;
 }
 
-//appends a new cell to the table
-int add_cell(row_t* row){
-    cell_t** newCells = row->cells;
-    if(row->len + 1 >= row->allocLen){
-        if(row->allocLen == 0) row->allocLen = 10;
-        row->allocLen *= 2;
-        newCells = realloc(row->cells, row->allocLen * sizeof(cell_t*));
-        if(newCells == NULL){
+//removes count cell slots starting at cell C, the cells have to be freed already
+void closeCells(row_t* row, int C, int count){
+    moveGap(row->cells, sizeof(cell_t*), row->len, row->allocLen, &row->gapStart, C);
+    row->len -= count;
+    row->cells = shrinkGap(row->cells, sizeof(cell_t*), row->len, &row->allocLen, &row->gapStart);
+}
+
+//fills count opened cell slots starting at cell C with new empty cells
+int fillCells(row_t* row, int C, int count){
+    for(int j = C; j < C + count; j++){
+        if((CELLP(row, j) = cell_ctor()) == NULL){
+            //give back the slots that didn't get a cell
+            row->len -= C + count - j;
+            row->gapStart -= C + count - j;
             return EXIT_FAILURE;
-        }  
+        }
     }
-    
-    newCells[row->len] = cell_ctor();
-    if(newCells[row->len] == NULL){
-        free(newCells);
+    return EXIT_SUCCESS;
+}
+
+//appends a new row to the table
+int add_row(table_t* table){
+    if(openRows(table, table->len, 1)){
+        return EXIT_FAILURE;
+    }
+    if((ROW_SLOT(table->len - 1) = row_ctor()) == NULL){
+        table->len--;
+        table->gapStart--;
         return EXIT_FAILURE;
     }
-    row->len++;
-    row->cells = newCells;
 
     return EXIT_SUCCESS;
 }
 
-//inserts a new row before row R
-int insert_row(table_t* table, int R){
-    //selected row doesn't exist, append rows
-    if(R >= table->len){
-        while(table->len <= R){
-            if(add_row(table)){
-                fprintf(stderr, "Memory allocation error\n");
-                return EXIT_FAILURE;
-            }
-        }
-        return EXIT_SUCCESS;
-    }
+//stores the empty cells of row up to collumn count, so they can be written
+int storeCells(row_t* row, int count){
+    if(row->len >= count) return EXIT_SUCCESS;
+    int C = row->len;
+    if(openCells(row, C, count - C)) return EXIT_FAILURE;
+    return fillCells(row, C, count - C);
+}
 
-    //if allocated memory is too small, reallocate double the size
-    row_t** newRows = table->rows;
-    if(table->len + 1 >= table->allocLen){
-        if(table->allocLen == 0) table->allocLen = 10;
-        table->allocLen *= 2;
-        newRows = realloc(table->rows, table->allocLen * sizeof(row_t*));
-        if(newRows == NULL){
-            fprintf(stderr, "Memory allocation error\n");
-            return EXIT_FAILURE;
-        }
-    }
-    
-    //move rows after position R by one
-    for(int i = table->len; i > R; i--){
-        newRows[i] = newRows[i-1];
+//inserts count new rows before row R, if R is past the end of the table,
+//empty rows are appended up to it first
+int insert_row(table_t* table, int R, int count){
+    if(R > table->len){
+        count += R - table->len;
+        R = table->len;
     }
 
-    //create the row and save it
-    newRows[R] = row_ctor();
-    if(newRows[R] == NULL){
-        free(newRows);
+    if(openRows(table, R, count)){
         fprintf(stderr, "Memory allocation error\n");
         return EXIT_FAILURE;
     }
-    table->len++;
-    table->rows = newRows;
+
+    //create the rows and save them
+    for(int i = R; i < R + count; i++){
+        row_t* row = row_ctor();
+        if(row == NULL){
+            //give back the slots that didn't get a row
+            table->len -= R + count - i;
+            table->gapStart -= R + count - i;
+            fprintf(stderr, "Memory allocation error\n");
+            return EXIT_FAILURE;
+        }
+        //new rows store no cells, all of them are empty
+        ROW_SLOT(i) = row;
+    }
 
     return EXIT_SUCCESS;
 }
 
-//insert a collumn before collumn C
-int insert_col(table_t* table, int C){
+//insert count collumns before collumn C
+int insert_col(table_t* table, int C, int count){
+    dropIndexes(table);
     //for each row
     for(int i = 0; i < table->len; i++){
-        //selected collumn doesn't exist, append new ones
-        if(C > table->rows[i]->len){
-            while(table->rows[i]->len <= C){
-                if(add_cell(table->rows[i])){
-                    fprintf(stderr, "Memory allocation error\n");
-                    return EXIT_FAILURE;
-                }
-            }
-            return EXIT_SUCCESS;
-        }
-
-        //double allocated memory if needed
-        cell_t** newCols = table->rows[i]->cells;
-        if(table->rows[i]->len + 1 >= table->rows[i]->allocLen){
-            if(table->rows[i]->allocLen == 0) table->rows[i]->allocLen = 10;
-            table->rows[i]->allocLen *= 2;
-            newCols = realloc(table->rows[i]->cells, table->rows[i]->allocLen * sizeof(cell_t*));
-            if(newCols == NULL){
-                fprintf(stderr, "Memory allocation error\n");
-                return EXIT_FAILURE;
-            }
-        }
-
-        //move collumns after C by one
-        for(int j = table->rows[i]->len; j > C; j--){
-            newCols[j] = newCols[j - 1];
-        }
+        //rows ending before C only have empty cells around it
+        if(ROW_SLOT(i)->len <= C) continue;
+        row_t* row = ROW(i);
 
-        //create and save new empty collumn
-        if((newCols[C] = cell_ctor()) == NULL){
+        //collumns added after the text only pad it
+        if(C < row->textCells) row->text = NULL;
+        //create and save new empty collumns
+        if(openCells(row, C, count) || fillCells(row, C, count)){
             fprintf(stderr, "Memory allocation error\n");
             return EXIT_FAILURE;
         }
-
-        table->rows[i]->len++;
-        table->rows[i]->cells = newCols;
     }
+    table->width = (table->width > C ? table->width : C) + count;
     return EXIT_SUCCESS;
 }
 
-//Append empty cells to make all rows have the same number of collumns
+//returns the number of collumns of the balanced table
+int tableWidth(table_t* table){
+    return table->len > 0 ? table->width : 0;
+}
+
+//Finds the number of collumns of the table, rows shorter than that only
+//store their cells up to the last one written, the rest are empty
 int balanceTable(table_t* table){
-    //find longest row
-    int max = 0;
+    //no rows were read since the last balancing
+    if(!table->ragged) return EXIT_SUCCESS;
+
+    //find longest row, stored rows know their length without being loaded
     for(int i = 0; i < table->len; i++){
-        if(table->rows[i]->len > max){
-            max = table->rows[i]->len;
+        if(ROW_SLOT(i)->len > table->width){
+            table->width = ROW_SLOT(i)->len;
         }
     }
+    table->ragged = false;
 
-    //append cells
-    for(int i = 0; i < table->len; i++){
-        for(int j = table->rows[i]->len; j < max; j++){
-            if(add_cell(table->rows[i])){
-                return EXIT_FAILURE;
-            }
-        }
+    return EXIT_SUCCESS;
+}
+
+//parses the collumns of row kept as text if any of them are between C1 and
+//(not including) C2
+int expandTail(table_t* table, row_t* row, int C1, int C2){
+    int raw = -1;
+    for(int j = C1; j < C2 && raw < 0; j++){
+        if(CELLP(row, j) == &rawCell) raw = j;
     }
+    if(raw < 0) return EXIT_SUCCESS;
+    while(raw > 0 && CELLP(row, raw - 1) == &rawCell) raw--;
 
+    row_t tail = {NULL, 0, 0, 0, NULL, NULL, 0, 0, NULL, 0, 0};
+    parseBuf_t buf = {NULL, 0, 0};
+    int err = PARSE_OK;
+    parseRow(row->tail, row->tail + row->tailLen, &tail, table->charClass, &buf, &err, 0, 0);
+    free(buf.text);
+    if(err != PARSE_OK){
+        freeCells(&tail, 0, tail.len);
+        free(tail.cells);
+        fprintf(stderr, "Memory allocation failure\n");
+        return EXIT_FAILURE;
+    }
+    for(int j = 0; j < tail.len; j++) CELLP(row, raw + j) = CELLP(&tail, j);
+    free(tail.cells);
+    row->tail = NULL;
     return EXIT_SUCCESS;
 }
 
 //delete all collumns between positions C1 and C2
 int dcol(table_t* table, int C1, int C2){
+    dropIndexes(table);
     for(int i = 0; i < table->len; i++){
+        row_t* row = ROW_SLOT(i);
         //delete collummns up to C2 or end of row, whichever is smaller
-        int maxCol = C2 > table->rows[i]->len ? table->rows[i]->len : C2;
-        for(int j = C1; j <= maxCol; j++){
-            //free the memory
-            free(table->rows[i]->cells[C1 - 1]->content);
-            free(table->rows[i]->cells[C1 - 1]);
-
-            //move rest of collumns by 1
-            for(int k = C1; k < table->rows[i]->len; k++){
-                table->rows[i]->cells[k - 1] = table->rows[i]->cells[k];
-            }
-
-            //reallocate smaller memory
-            cell_t** newCols = realloc(table->rows[i]->cells, (table->rows[i]->len - 1) * sizeof(cell_t*));
-            if(table->rows[i]->len - 1 != 0 && newCols == NULL){
-                fprintf(stderr, "Memory allocation error\n");
-                return EXIT_FAILURE;
+        int maxCol = C2 > row->len ? row->len : C2;
+        if(C1 > maxCol){
+            //only empty cells are deleted, but the text might have them
+            if(C1 - 1 < row->textCells) row->text = NULL;
+            continue;
+        }
+        if(!ROW_LOADED(row)){
+            //cutting off empty cells of a stored row doesn't need its text
+            if(maxCol == row->len && C1 - 1 >= row->page->lastFull){
+                row->len = C1 - 1;
+                continue;
             }
-            table->rows[i]->cells = newCols;
-            table->rows[i]->len--;
-            table->rows[i]->allocLen--;
+            row = ROW(i);
         }
+        //collumns kept as text are parsed before some of them are deleted
+        if(row->tail != NULL && expandTail(table, row, C1 - 1, maxCol)) return EXIT_FAILURE;
+        if(C1 - 1 < row->textCells) row->text = NULL;
+
+        //free the memory and widen the gap over the deleted collumns
+        freeCells(row, C1 - 1, maxCol);
+        closeCells(row, C1 - 1, maxCol - C1 + 1);
+    }
+    if(C1 <= C2 && C1 <= table->width) table->width -= (C2 < table->width ? C2 : table->width) - C1 + 1;
+    return EXIT_SUCCESS;
+}
+
+//checks if cell matches the filter predicate op with str, < and > compare
+//numbers and never match anything else
+bool filterMatch(cell_t* cell, int op, const char* str){
+    char tmp[NUM_TEXT_SIZE];
+    const char* text = cellText(cell, tmp);
+    if(op == FILTER_EQ) return !strcmp(text, str);
+    if(op == FILTER_NE) return strcmp(text, str) != 0;
+    if(op == FILTER_HAS) return strstr(text, str) != NULL;
+
+    double num, strNum;
+    char* endptr;
+    strNum = strtod(str, &endptr);
+    if(str[0] == 0 || endptr[0] != 0 || cellNum(cell, &num)) return false;
+    return op == FILTER_LT ? num < strNum : num > strNum;
+}
+
+//deletes the rows between R1 and R2 whose collumn C matches the predicate op
+//with str, the kept rows are moved up in one pass
+int filterRows(table_t* table, int R1, int R2, int C, int op, const char* str){
+    int maxRow = R2 > table->len ? table->len : R2;
+    if(R1 > maxRow) return EXIT_SUCCESS;
+
+    //with the gap at the end, the rows are in slots 0 up to len
+    moveGap(table->rows, sizeof(row_t*), table->len, table->allocLen, &table->gapStart, table->len);
+    int kept = R1 - 1;
+    for(int i = R1 - 1; i < maxRow; i++){
+        row_t* row = ROW(i);
+        if(filterMatch(cellAt(row, C - 1), op, str)) freeRow(row);
+        else table->rows[kept++] = row;
     }
+    int deleted = maxRow - kept;
+    if(deleted == 0) return EXIT_SUCCESS;
+    memmove(&table->rows[kept], &table->rows[maxRow], (table->len - maxRow) * sizeof(row_t*));
+    dropIndexes(table);
+    table->len -= deleted;
+    table->gapStart = table->len;
+    table->rows = shrinkGap(table->rows, sizeof(row_t*), table->len, &table->allocLen, &table->gapStart);
+    if(table->len == 0) table->width = 0;
     return EXIT_SUCCESS;
 }
 
@@ -431,54 +1602,51 @@ int dcol(table_t* table, int C1, int C2){
 int drow(table_t* table, int R1, int R2){
     //delete up to R2 or total number of rows, whichever is smaller
     int maxRow = R2 > table->len ? table->len : R2;
-    for(int j = R1; j <= maxRow; j++){
-        //free the memory
-        for(int i = 0; i < table->rows[R1-1]->len; i++){
-            free(table->rows[R1-1]->cells[i]->content);
-            free(table->rows[R1-1]->cells[i]);
-        }
-        free(table->rows[R1-1]->cells);
-        free(table->rows[R1-1]);
-
-        //move rest of rows by 1
-        for(int i = R1; i < table->len; i++){
-            table->rows[i - 1] = table->rows[i];
-        }
+    if(R1 > maxRow) return EXIT_SUCCESS;
 
-        //reallocate smaller memory
-        row_t** newRows = realloc(table->rows, (table->len - 1) * sizeof(row_t*));
-        if(table->len - 1 != 0 && newRows == NULL){
-            fprintf(stderr, "Memory allocation error\n");
-            return EXIT_FAILURE;
-        }
-        table->rows = newRows;
-        table->len--;
-        table->allocLen--;
+    //free the memory and widen the gap over the deleted rows
+    for(int i = R1 - 1; i < maxRow; i++){
+        freeRow(ROW_SLOT(i));
     }
-    
+    closeRows(table, R1 - 1, maxRow - R1 + 1);
+    //a table without rows has no collumns
+    if(table->len == 0) table->width = 0;
+
     return EXIT_SUCCESS;
 }
 
+//returns the position of the last non empty cell of a loaded row counted
+//from 1, 0 if there is none
+int rowLastFull(row_t* row){
+    //index of the first collumn kept as text
+    int raw = -1, full = 0;
+    for(int j = 0; j < row->len; j++){
+        cell_t* cell = CELLP(row, j);
+        if(cell == &rawCell && raw < 0) raw = j;
+        if(cell == &rawCell ? j - raw < row->tailFull : !cellEmpty(cell)) full = j + 1;
+    }
+    return full;
+}
+
 //removes empty last collumns
 int trimTable(table_t* table){
     int maxCol = 0;
-    int maxRow = 0, maxRowNum = 0;
-    //finds the longest row and its length
+    //finds the last non empty collumn
     for(int i = 0; i < table->len; i++){
-        for(int j = 0; j < table->rows[i]->len; j++){
-            if(strcmp(CELL(i, j), "")){
-                if(j > maxCol){
-                    maxCol = j;
-                } 
-            }
-            if(j > maxRow){
-                maxRow = j;
-                maxRowNum = i;
-            }
+        row_t* row = ROW_SLOT(i);
+        //a stored row knows its last non empty cell
+        if(!ROW_LOADED(row)){
+            int full = row->page->lastFull < row->len ? row->page->lastFull : row->len;
+            if(full - 1 > maxCol) maxCol = full - 1;
+            continue;
         }
+        int full = rowLastFull(row);
+        if(full - 1 > maxCol) maxCol = full - 1;
     }
 
-    if(dcol(table, maxCol + 2, table->rows[maxRowNum]->len)){
+    //nothing to remove
+    if(table->len == 0 || maxCol + 2 > table->width) return EXIT_SUCCESS;
+    if(dcol(table, maxCol + 2, table->width)){
         return EXIT_FAILURE;
     }
 
@@ -494,210 +1662,676 @@ int expandTable(table_t* table, int R, int C){
         }
     }
 
-    while(table->rows[R]->len <= C){
-        if(add_cell(table->rows[R])){
-            fprintf(stderr, "Memory allocation failure\n");
-            return EXIT_FAILURE;
-        }
+    //the new cells are empty, they are stored once they are written
+    if(table->width <= C) table->width = C + 1;
+
+    return EXIT_SUCCESS;
+}
+
+//creates a cell holding a copy of len characters of text
+cell_t* cell_from(const char* text, int len){
+    if(len == 0) return cell_ctor();
+    cell_t* cell = malloc(sizeof(cell_t));
+    if(cell == NULL){
+        return NULL;
     }
 
-    if(balanceTable(table)){
-        fprintf(stderr, "Memory allocation failure\n");
-        return EXIT_FAILURE;
+    cell->len = len + 1;
+    cell->refs = 1;
+    cell->numState = NUM_UNKNOWN;
+    cell->plain = false;
+    cell->content = malloc(cell->len * sizeof(char));
+    if(cell->content == NULL){
+        free(cell);
+        return NULL;
     }
+    memcpy(cell->content, text, len);
+    cell->content[len] = 0;
 
-    return EXIT_SUCCESS;
+    return cell;
 }
 
-//Appends one character to cell
-int appendToCell(cell_t* cell, char c){
-    char* newContent = cell->content;
-    if(cell->len + 1 >= cell->allocLen){
-        cell->allocLen *= 2;
-        newContent = realloc(cell->content, cell->allocLen * sizeof(char));
-        if(newContent == NULL){
-            return EXIT_FAILURE;
-        }
+//appends len characters to a growing parse buffer
+int appendToBuf(parseBuf_t* buf, const char* text, int len){
+    if(buf->len + len > buf->allocLen){
+        int newAllocLen = buf->allocLen == 0 ? 64 : buf->allocLen;
+        while(newAllocLen < buf->len + len) newAllocLen *= 2;
+        char* newText = realloc(buf->text, newAllocLen);
+        if(newText == NULL) return EXIT_FAILURE;
+        buf->text = newText;
+        buf->allocLen = newAllocLen;
     }
-    
-    newContent[cell->len] = c;
-    cell->content = newContent;
-    cell->len++;
+    memcpy(buf->text + buf->len, text, len);
+    buf->len += len;
     return EXIT_SUCCESS;
 }
 
-//Reads cell content from file until delimiter or ending quote
-int readCell(FILE* file, cell_t* cell, char* delim){
-    char c = fgetc(file);
-    //return correct value if cell is empty
-    if(c == '\n') return LAST_CELL;
-    else if(c == EOF) return LAST_ROW;
-    else if(isDelim(c, delim)) return NOT_LAST_CELL;
+//keeps the rest of the line starting at p as the text of the row's last
+//collumns if it's formatted like the output, returns the start of the next
+//line, or NULL if the rest has to be parsed or on error
+const char* keepTail(const char* p, const char* end, row_t* row,
+    const unsigned char* charClass, char delim, int* err){
+    lineInfo_t info;
+    const char* lineEnd = measureLine(p, end, charClass, delim, &info);
+    if(lineEnd == NULL){
+        *err = PARSE_QUOTE;
+        return NULL;
+    }
+    if(!info.verbatim) return NULL;
+    int C = row->len;
+    if(openCells(row, C, info.cells)){
+        *err = PARSE_ALLOC;
+        return NULL;
+    }
+    for(int j = C; j < row->len; j++) CELLP(row, j) = &rawCell;
+    row->tail = p;
+    row->tailLen = lineEnd - p;
+    row->tailFull = info.lastFull;
+    return lineEnd < end ? lineEnd + 1 : lineEnd;
+}
+
+//parses one line of input starting at p into row, cells end at delim and
+//the line at newline or end, cells after the first keep ones are kept as
+//text unless keep is 0, delim is the one the output uses, returns the start
+//of the next line or NULL on error
+const char* parseRow(const char* p, const char* end, row_t* row,
+    const unsigned char* charClass, parseBuf_t* buf, int* err, int keep, char delim){
+    const char* line = p;
+    bool lastCell = false, verbatim = true;
+    row->text = NULL;
+    while(!lastCell){
+        bool inQuotes = false;
+        buf->len = 0;
+        while(true){
+            //copy a run of plain characters at once
+            const char* run = p;
+            while(p < end && !(charClass[(unsigned char)*p] & (CH_DELIM | CH_SPECIAL))) p++;
+            if(p > run && appendToBuf(buf, run, p - run)){
+                *err = PARSE_ALLOC;
+                return NULL;
+            }
 
-    bool inQuotes = false;
-    while(inQuotes || !(isDelim(c, delim) || c == '\n' || c == EOF)){
-        if(c == '\\'){
-            if((c = fgetc(file)) == '\n'){
+            if(p == end || *p == '\n'){
+                if(inQuotes){
+                    *err = PARSE_QUOTE;
+                    return NULL;
+                }
+                if(verbatim){
+                    row->text = line;
+                    row->textLen = p - line;
+                }
+                if(p < end) p++;
+                lastCell = true;
                 break;
             }
-            fseek(file, -1, SEEK_CUR);
-            //character is escaped, save next character
-            if(appendToCell(cell, fgetc(file))){
-                fprintf(stderr, "Memory allocation failure\n");
-                return EXIT_FAILURE;
+            else if(*p == '\\'){
+                //escaped newline still ends the row, any other character is saved
+                verbatim = false;
+                p++;
+                if(p == end || *p == '\n'){
+                    if(p < end) p++;
+                    lastCell = true;
+                    break;
+                }
+                if(appendToBuf(buf, p, 1)){
+                    *err = PARSE_ALLOC;
+                    return NULL;
+                }
+                p++;
             }
-        }
-        else if(c == '"') inQuotes = !inQuotes;
-        else{
-            if(c == '\n'){
-                fprintf(stderr, "No closing quote on row\n");
-                return EXIT_FAILURE;
+            else if(*p == '"'){
+                verbatim = false;
+                inQuotes = !inQuotes;
+                p++;
             }
-            if(appendToCell(cell, c)){
-                fprintf(stderr, "Memory allocation failure\n");
-                return EXIT_FAILURE;
+            else if(inQuotes){
+                //delim in quotes is a part of the cell
+                if(appendToBuf(buf, p, 1)){
+                    *err = PARSE_ALLOC;
+                    return NULL;
+                }
+                p++;
+            }
+            else{
+                //the output only separates cells by the first delim character
+                if(*p != delim) verbatim = false;
+                p++;
+                break;
             }
         }
-        c = fgetc(file);
-    } 
-    //append zero character to cell content to terminate it
-    if(appendToCell(cell, 0)){
-        fprintf(stderr, "Memory allocation failure\n");
-        return EXIT_FAILURE;
-    }
-    //return correct value when cell isn't empty
-    if(c == '\n' || fgetc(file) == EOF){
-        if(fgetc(file) == EOF){
-            return LAST_ROW;
+
+        //save the cell at the end of row
+        cell_t* cell = cell_from(buf->text, buf->len);
+        if(cell == NULL || openCells(row, row->len, 1)){
+            if(cell != NULL) unrefCell(cell);
+            *err = PARSE_ALLOC;
+            return NULL;
         }
-        fseek(file, -1, SEEK_CUR);
-        return LAST_CELL;
-    } 
-    fseek(file, -1, SEEK_CUR);
-    return NOT_LAST_CELL;
-}
+        CELLP(row, row->len - 1) = cell;
 
-//Go through input file and read cell by cell
-int readFile(FILE* file, char* delim, table_t* table){
-    char c = fgetc(file);
-    if(c == EOF){
-        fprintf(stderr, "Input table empty\n");
-        return EXIT_FAILURE;
+        if(!lastCell && row->len == keep){
+            const char* next = keepTail(p, end, row, charClass, delim, err);
+            if(next != NULL && verbatim){
+                row->text = line;
+                row->textLen = row->tail + row->tailLen - line;
+            }
+            if(next != NULL || *err != PARSE_OK){
+                row->textCells = row->len;
+                return next;
+            }
+        }
     }
+    row->textCells = row->len;
+    return p;
+}
 
-    //add first row and column
-    if(add_row(table) || add_cell(table->rows[0])){
-        fprintf(stderr, "Error while saving table to memory\n");
-        return EXIT_FAILURE;
-    }
-    fseek(file, -1, SEEK_CUR);
-    
-    int currRow = 0, currCell = 0;
+//creates the storage of a row of a paged table, it isn't loaded or stored yet
+rowPage_t* newPage(pager_t* pager, row_t* row){
+    rowPage_t* page = calloc(1, sizeof(rowPage_t));
+    if(page == NULL) return NULL;
+    page->row = row;
+    page->pager = pager;
+    page->bytes = -1;
+    return page;
+}
 
+//counts the cells of one line of input starting at p the same way parseRow
+//splits it, delim is the character the output separates cells by, returns
+//the end of the line or NULL if a quote isn't closed
+const char* measureLine(const char* p, const char* end, const unsigned char* charClass,
+    char delim, lineInfo_t* info){
+    bool inQuotes = false, full = false;
+    info->cells = 0;
+    info->lastFull = 0;
+    info->verbatim = true;
+    info->escapedEnd = false;
     while(true){
-        int rslt = readCell(file, table->rows[currRow]->cells[currCell], delim);
-        //there are more cells on row, increment currCell and continue
-        if(rslt == NOT_LAST_CELL){
-            if(add_cell(table->rows[currRow])){
-                fprintf(stderr, "Error while saving table to memory\n");
-                    return EXIT_FAILURE;
+        //skip a run of plain characters at once
+        const char* run = p;
+        while(p < end && !(charClass[(unsigned char)*p] & (CH_DELIM | CH_SPECIAL))) p++;
+        if(p > run) full = true;
+        if(p == end || *p == '\n') break;
+        if(*p == '\\'){
+            //escaped newline still ends the row
+            info->verbatim = false;
+            if(++p == end || *p == '\n'){
+                info->escapedEnd = true;
+                break;
             }
-            currCell++;
+            full = true;
         }
-        //last cell on row, increment currRow and reset currCell, continue
-        else if(rslt == LAST_CELL){
-            currRow++;
-            currCell = 0;
-            if(fgetc(file) == EOF) return EXIT_SUCCESS;
-            else{
-                fseek(file, -1, SEEK_CUR);
-                if(add_row(table) || add_cell(table->rows[currRow])){
-                    fprintf(stderr, "Error while saving table to memory\n");
-                    return EXIT_FAILURE;
-                }
-            }
+        else if(*p == '"'){
+            info->verbatim = false;
+            inQuotes = !inQuotes;
         }
-        //last cell of table was read, exit function
-        else if(rslt == LAST_ROW){
-            return EXIT_SUCCESS;
+        else if((charClass[(unsigned char)*p] & CH_DELIM) && !inQuotes){
+            //the output only separates cells by the first delim character
+            if(*p != delim) info->verbatim = false;
+            info->cells++;
+            if(full) info->lastFull = info->cells;
+            full = false;
         }
-        else return EXIT_FAILURE;
+        else full = true;
+        p++;
     }
+    if(inQuotes && !info->escapedEnd) return NULL;
+    info->cells++;
+    if(full) info->lastFull = info->cells;
+    return p;
 }
 
-//parses and returns a text parameter for a command
-char* parseStr(char* command){
-    char* str = calloc(strlen(command) + 1, sizeof(char));
-    if(str == NULL) return NULL;
-    bool inQuotes = false;
-    int offset = 0;
-    int i = 0;
-    while(command[i]){
-        if(command[i] == '"') inQuotes = !inQuotes;
-        else if(command[i] == '\\'){
-            i++;
-            str[offset] = command[i]; 
-            offset++;
-        }
-        else{
-            str[offset] = command[i];
-            offset++;
-        } 
-        i++;
+//measures one line of input starting at p for a row of a paged table without
+//saving the cells, returns the start of the next line or NULL on error
+const char* scanRow(const char* p, const char* end, row_t* row,
+    const unsigned char* charClass, pager_t* pager, int* err){
+    rowPage_t* page = row->page;
+    lineInfo_t info;
+    const char* lineEnd = measureLine(p, end, charClass, pager->delim[0], &info);
+    if(lineEnd == NULL){
+        *err = PARSE_QUOTE;
+        return NULL;
     }
-    return str;
+    page->cells = info.cells;
+    page->lastFull = info.lastFull;
+    page->verbatim = info.verbatim;
+    page->offset = p - pager->source;
+    page->bytes = lineEnd - p;
+    row->len = page->cells;
+    return lineEnd < end ? lineEnd + 1 : lineEnd;
 }
 
-//parses and returns a selection command for a single cell command.name is UNKNOWN if
-//selection failed, SELECTION if succeeded
-command_t parseSingleSelect(char* command, table_t* table){
-    command_t cmd;
-    selection_t select;
-    cmd.name = UNKNOWN;
-    cmd.str = NULL;
-    //convert row number, if replaced by _, save whole row
-    char* endptr;
-    int R = strtol(&command[1], &endptr, 10);
-    if(R < 1){
-        if(!strncmp(command, "[_,", strlen("[_,"))){
-            select.R1 = 1;
-            select.R2 = table->len;
-            endptr = &command[2];
+//replaces cell C of row by the cell with the same text in the collumn's
+//dictionary or adds it there, a shared cell gets its number parsed and its
+//format checked now, so the slots holding it only ever read it
+void internCell(dict_t* dict, row_t* row, int C, const unsigned char* charClass){
+    cell_t* cell = CELLP(row, C);
+    if(dict->full || cell == &emptyCell || cell == &rawCell) return;
+    if(2 * (dict->len + 1) > dict->allocLen){
+        int newAllocLen = dict->allocLen == 0 ? 16 : dict->allocLen * 2;
+        cell_t** newCells = dict->len < DICT_MAX ? calloc(newAllocLen, sizeof(cell_t*)) : NULL;
+        if(newCells == NULL){
+            //too many texts to share, the collumn keeps a cell in each slot
+            free(dict->cells);
+            dict->cells = NULL;
+            dict->full = true;
+            return;
         }
-        else return cmd;
-    } 
-    else{
-        select.R1 = R;
-        select.R2 = R;
+        for(int k = 0; k < dict->allocLen; k++){
+            if(dict->cells[k] == NULL) continue;
+            uint32_t h = hashText(dict->cells[k]->content) & (newAllocLen - 1);
+            while(newCells[h] != NULL) h = (h + 1) & (newAllocLen - 1);
+            newCells[h] = dict->cells[k];
+        }
+        free(dict->cells);
+        dict->cells = newCells;
+        dict->allocLen = newAllocLen;
     }
-    //convert col number, if replaced by _, save whole col
-    char* endptr2;
-    R = strtol(&endptr[1], &endptr2, 10);
-    if(R < 1){
-        if(!strncmp(endptr2, "_]", strlen("_]"))){
-            select.C1 = 1;
-            select.C2 = table->rows[0]->len;
+    uint32_t h = hashText(cell->content) & (dict->allocLen - 1);
+    for(; dict->cells[h] != NULL; h = (h + 1) & (dict->allocLen - 1)){
+        cell_t* shared = dict->cells[h];
+        if(shared->len == cell->len && !memcmp(shared->content, cell->content, cell->len)){
+            shared->refs++;
+            unrefCell(cell);
+            CELLP(row, C) = shared;
+            return;
         }
-        else return cmd;
     }
-    else{
-        select.C1 = R; 
-        select.C2 = R;
+    double num;
+    cellNum(cell, &num);
+    unsigned char flags = 0;
+    for(int k = 0; k < cell->len - 1; k++) flags |= charClass[(unsigned char)cell->content[k]];
+    cell->plain = !(flags & (CH_QUOTE | CH_ESCAPE));
+    dict->cells[h] = cell;
+    dict->len++;
+}
+
+//parses all lines of one chunk into its own block of rows, collumns with few
+//distinct texts share one cell for each of them
+void* parseChunk(void* arg){
+    parseChunk_t* chunk = arg;
+    parseBuf_t buf = {NULL, 0, 0};
+    //dictionaries of the collumns seen so far
+    dict_t* dicts = NULL;
+    int dictsLen = 0;
+    const char* p = chunk->begin;
+    while(p < chunk->end){
+        if(chunk->len == chunk->allocLen){
+            int newAllocLen = chunk->allocLen == 0 ? 1024 : chunk->allocLen * 2;
+            row_t** newRows = realloc(chunk->rows, newAllocLen * sizeof(row_t*));
+            if(newRows == NULL){
+                chunk->err = PARSE_ALLOC;
+                break;
+            }
+            chunk->rows = newRows;
+            chunk->allocLen = newAllocLen;
+        }
+        row_t* row = row_ctor();
+        if(row == NULL){
+            chunk->err = PARSE_ALLOC;
+            break;
+        }
+        chunk->rows[chunk->len++] = row;
+        if(chunk->pager != NULL){
+            if((row->page = newPage(chunk->pager, row)) == NULL){
+                chunk->err = PARSE_ALLOC;
+                break;
+            }
+            p = scanRow(p, chunk->end, row, chunk->charClass, chunk->pager, &chunk->err);
+        }
+        else p = parseRow(p, chunk->end, row, chunk->charClass, &buf, &chunk->err, chunk->keepCols, chunk->delim);
+        if(p == NULL){
+            break;
+        }
+        if(chunk->pager != NULL) continue;
+        //rows are rarely widened, the slots past the last cell are given back
+        if(row->allocLen > row->len && row->len > 0){
+            cell_t** newCells = realloc(row->cells, row->len * sizeof(cell_t*));
+            if(newCells != NULL){
+                row->cells = newCells;
+                row->allocLen = row->len;
+            }
+        }
+        if(row->len > dictsLen){
+            //without more dictionaries the new collumns just aren't shared
+            dict_t* newDicts = realloc(dicts, row->len * sizeof(dict_t));
+            if(newDicts != NULL){
+                memset(&newDicts[dictsLen], 0, (row->len - dictsLen) * sizeof(dict_t));
+                dicts = newDicts;
+                dictsLen = row->len;
+            }
+        }
+        for(int j = 0; j < row->len && j < dictsLen; j++){
+            internCell(&dicts[j], row, j, chunk->charClass);
+        }
     }
-    
-    cmd.name = SELECTION;
-    cmd.selection = select;
-    return cmd;
+    for(int j = 0; j < dictsLen; j++) free(dicts[j].cells);
+    free(dicts);
+    free(buf.text);
+    return NULL;
 }
 
-//parses and saves selection for multiple cells, command.name is UNKNOWN if
-//selection failed, SELECTION if succeeded
-command_t parseMultipleSelect(char* command, table_t* table){
-    command_t cmd;
-    selection_t select;
-    cmd.name = UNKNOWN;
-    cmd.str = NULL;
-    //get first number
+//maps the whole file into memory and saves its size, returns NULL on error
+char* mapFile(const char* fileName, size_t* size){
+    int fd = open(fileName, O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st)){
+        if(fd >= 0) close(fd);
+        fprintf(stderr, "Error while reading file\n");
+        return NULL;
+    }
+    if(st.st_size == 0){
+        close(fd);
+        fprintf(stderr, "Input table empty\n");
+        return NULL;
+    }
+    char* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED){
+        fprintf(stderr, "Error while reading file\n");
+        return NULL;
+    }
+    *size = st.st_size;
+    return data;
+}
+
+//Maps the input file and parses it into the table, the input is split into
+//chunks at newlines that are parsed in parallel and stitched in order. A row
+//can't continue past a newline (even in quotes), so the chunks are independent.
+//Rows of a paged table are only measured and stay in the mapped file.
+int readFile(char* fileName, table_t* table){
+    size_t size;
+    char* data = mapFile(fileName, &size);
+    if(data == NULL) return EXIT_FAILURE;
+    const char* end = data + size;
+    //rows of a paged table, tails of rows and unchanged rows are read from the
+    //input later
+    table->source = data;
+    table->sourceLen = size;
+    if(table->pager != NULL) table->pager->source = data;
+
+    //split the input into chunks of at least PARSE_CHUNK_MIN bytes
+    int count = threadCount();
+    if((size_t)count > size / PARSE_CHUNK_MIN) count = size / PARSE_CHUNK_MIN;
+    if(count < 1) count = 1;
+    parseChunk_t chunks[MAX_THREADS];
+    const char* begin = data;
+    for(int i = 0; i < count; i++){
+        const char* chunkEnd = end;
+        if(i != count - 1){
+            //the chunk ends after the first newline past its share of bytes
+            const char* split = data + size / count * (i + 1);
+            if(split < begin) split = begin;
+            chunkEnd = memchr(split, '\n', end - split);
+            chunkEnd = chunkEnd == NULL ? end : chunkEnd + 1;
+        }
+        parseChunk_t chunk = {begin, chunkEnd, table->charClass, table->pager, table->keepCols, table->delim[0], NULL, 0, 0, PARSE_OK};
+        chunks[i] = chunk;
+        begin = chunkEnd;
+    }
+    runParallel(&table->pool, parseChunk, chunks, sizeof(parseChunk_t), count);
+
+    //stitch the blocks into the table in order
+    int total = 0, err = PARSE_OK;
+    for(int i = 0; i < count; i++){
+        total += chunks[i].len;
+        if(err == PARSE_OK) err = chunks[i].err;
+    }
+    if(err == PARSE_OK && openRows(table, table->len, total)){
+        err = PARSE_ALLOC;
+    }
+    if(err != PARSE_OK){
+        for(int i = 0; i < count; i++){
+            for(int j = 0; j < chunks[i].len; j++) freeRow(chunks[i].rows[j]);
+            free(chunks[i].rows);
+        }
+        if(err == PARSE_QUOTE) fprintf(stderr, "No closing quote on row\n");
+        else fprintf(stderr, "Error while saving table to memory\n");
+        return EXIT_FAILURE;
+    }
+    int R = table->len - total;
+    for(int i = 0; i < count; i++){
+        if(chunks[i].len > 0) memcpy(&ROW_SLOT(R), chunks[i].rows, chunks[i].len * sizeof(row_t*));
+        R += chunks[i].len;
+        free(chunks[i].rows);
+    }
+    table->ragged = true;
+    //loading rows of a paged table isn't thread safe
+    if(table->pager != NULL) table->pool.serial = true;
+
+    return EXIT_SUCCESS;
+}
+
+//creates a temporary page file, it is deleted right away and lives while
+//it's open
+int openPageFile(){
+    char* dir = getenv("TMPDIR");
+    char path[PATH_SIZE];
+    snprintf(path, PATH_SIZE, "%s/sps-pages-XXXXXX", dir != NULL && dir[0] ? dir : "/tmp");
+    int fd = mkstemp(path);
+    if(fd < 0){
+        fprintf(stderr, "Error while creating page file\n");
+        return -1;
+    }
+    unlink(path);
+    return fd;
+}
+
+//creates the pager of a table kept in at most limit bytes of memory, there
+//is no page file without a limit, keepText is set for --lazy
+int initPager(table_t* table, size_t limit, bool keepText){
+    pager_t* pager = calloc(1, sizeof(pager_t));
+    if(pager == NULL){
+        fprintf(stderr, "Memory allocation failure\n");
+        return EXIT_FAILURE;
+    }
+    pager->fd = -1;
+    pager->forkFd = -1;
+    if(limit < SIZE_MAX && (pager->fd = openPageFile()) < 0){
+        free(pager);
+        return EXIT_FAILURE;
+    }
+    pager->limit = limit;
+    pager->keepText = keepText;
+    pager->keepCols = table->keepCols;
+    pager->charClass = table->charClass;
+    pager->delim = table->delim;
+    pager->out.fd = -1;
+    table->pager = pager;
+    return EXIT_SUCCESS;
+}
+
+//gives the pager of a forked copy of the table a page file of its own, the
+//one of the parent keeps the pages written before the fork and isn't
+//written anymore
+int forkPager(pager_t* pager){
+    if(pager->fd < 0) return EXIT_SUCCESS;
+    int fd = openPageFile();
+    if(fd < 0) return EXIT_FAILURE;
+    pager->forkFd = pager->fd;
+    pager->forkLen = pager->fileLen;
+    pager->fd = fd;
+    return EXIT_SUCCESS;
+}
+
+//estimates the memory used by a loaded row, cells shared with other rows are
+//counted by each of them
+size_t rowSize(row_t* row){
+    size_t size = sizeof(row_t) + sizeof(rowPage_t) + row->allocLen * sizeof(cell_t*);
+    for(int j = 0; j < row->len; j++){
+        cell_t* cell = CELLP(row, j);
+        if(cell != &emptyCell && cell != &rawCell) size += sizeof(cell_t) + cell->len;
+    }
+    return size;
+}
+
+//parses the stored text of a row back into its cells, the row keeps its len,
+//cells added by balancing are empty and cells removed by trimming were too
+int loadPage(pager_t* pager, row_t* row){
+    rowPage_t* page = row->page;
+    const char* text = storedText(pager, page);
+    if(text == NULL) return EXIT_FAILURE;
+    int len = row->len, err = PARSE_OK;
+    row->len = 0;
+    //the text read from the page file is overwritten by the next read, and
+    //cells cut off the row while it was stored can't stay in its tail
+    int keep = page->inPageFile || len < page->cells ? 0 : pager->keepCols;
+    if(parseRow(text, text + page->bytes, row, pager->charClass, &pager->buf, &err, keep, pager->delim[0]) == NULL){
+        return EXIT_FAILURE;
+    }
+    if(page->inPageFile) row->text = NULL;
+    if(row->len > len){
+        freeCells(row, len, row->len);
+        closeCells(row, len, row->len - len);
+    }
+    else if(row->len < len){
+        int C = row->len;
+        if(openCells(row, C, len - C) || fillCells(row, C, len - C)) return EXIT_FAILURE;
+    }
+    page->loaded = true;
+    page->size = rowSize(row);
+    return EXIT_SUCCESS;
+}
+
+//frees the cells of a loaded row, the row is formatted like the output and
+//appended to the page file unless that's what is stored for it already
+int evictPage(pager_t* pager, rowPage_t* page){
+    row_t* row = page->row;
+    pager->out.len = 0;
+    if(putRow(&pager->out, row, 0, pager->delim, pager->charClass)) return EXIT_FAILURE;
+    bool changed = !page->verbatim || page->bytes != pager->out.len;
+    if(!changed){
+        const char* text = storedText(pager, page);
+        if(text == NULL) return EXIT_FAILURE;
+        changed = memcmp(text, pager->out.buf, pager->out.len) != 0;
+    }
+    if(changed){
+        if(writeAll(pager->fd, pager->out.buf, pager->out.len)) return EXIT_FAILURE;
+        page->inPageFile = true;
+        page->verbatim = true;
+        page->offset = pager->fileLen;
+        page->bytes = pager->out.len;
+        pager->fileLen += pager->out.len;
+        page->cells = row->len;
+        page->lastFull = rowLastFull(row);
+    }
+    unlinkPage(page);
+    freeCells(row, 0, row->len);
+    free(row->cells);
+    row->cells = NULL;
+    row->allocLen = 0;
+    row->gapStart = 0;
+    row->tail = NULL;
+    row->text = NULL;
+    page->loaded = false;
+    return EXIT_SUCCESS;
+}
+
+//returns the slot of a row of a paged table after loading its cells, the
+//least recently used rows are unloaded when the pager is over its limit,
+//rows are used through ROW which can't report errors, so they end the program
+row_t** pageIn(table_t* table, int slot){
+    pager_t* pager = table->pager;
+    row_t* row = table->rows[slot];
+    rowPage_t* page = row->page;
+    if(page != NULL && page == pager->first) return &table->rows[slot];
+
+    bool err = false;
+    if(page == NULL){
+        //a row added since the table was read
+        err = (page = row->page = newPage(pager, row)) == NULL;
+        if(!err){
+            page->loaded = true;
+            page->size = rowSize(row);
+        }
+    }
+    else if(page->loaded) unlinkPage(page);
+    else err = loadPage(pager, row);
+    if(!err) pushPage(page);
+    while(!err && pager->used > pager->limit && pager->loaded > PAGER_PINNED){
+        err = evictPage(pager, pager->last);
+    }
+    if(err){
+        fprintf(stderr, "Error while loading table rows\n");
+        exit(EXIT_FAILURE);
+    }
+    return &table->rows[slot];
+}
+
+//parses and returns a text parameter for a command
+char* parseStr(char* command){
+    char* str = calloc(strlen(command) + 1, sizeof(char));
+    if(str == NULL) return NULL;
+    bool inQuotes = false;
+    int offset = 0;
+    int i = 0;
+    while(command[i]){
+        if(command[i] == '"') inQuotes = !inQuotes;
+        else if(command[i] == '\\'){
+            i++;
+            str[offset] = command[i]; 
+            offset++;
+        }
+        else{
+            str[offset] = command[i];
+            offset++;
+        } 
+        i++;
+    }
+    return str;
+}
+
+//parses and returns a selection command for a single cell command.name is UNKNOWN if
+//selection failed, SELECTION if succeeded
+command_t parseSingleSelect(char* command){
+    command_t cmd = {0};
+    selection_t select;
+    cmd.name = UNKNOWN;
+    cmd.str = NULL;
+    //convert row number, if replaced by _, save whole row
+    char* endptr;
+    int R = strtol(&command[1], &endptr, 10);
+    if(R < 1){
+        if(!strncmp(command, "[_,", strlen("[_,"))){
+            select.R1 = 1;
+            select.R2 = 0;
+            cmd.ends |= SEL_LAST_ROW;
+            endptr = &command[2];
+        }
+        else return cmd;
+    } 
+    else{
+        select.R1 = R;
+        select.R2 = R;
+    }
+    //convert col number, if replaced by _, save whole col
+    char* endptr2;
+    R = strtol(&endptr[1], &endptr2, 10);
+    if(R < 1){
+        if(!strncmp(endptr2, "_]", strlen("_]"))){
+            select.C1 = 1;
+            select.C2 = 0;
+            cmd.ends |= SEL_LAST_COL;
+        }
+        else return cmd;
+    }
+    else{
+        select.C1 = R; 
+        select.C2 = R;
+    }
+    
+    cmd.name = SELECTION;
+    cmd.selection = select;
+    return cmd;
+}
+
+//parses and saves selection for multiple cells, command.name is UNKNOWN if
+//selection failed, SELECTION if succeeded
+command_t parseMultipleSelect(char* command){
+    command_t cmd = {0};
+    selection_t select;
+    cmd.name = UNKNOWN;
+    cmd.str = NULL;
+    //get first number
     char* endptr;
     int R = strtol(&command[1], &endptr, 10);
     if(R < 1){
@@ -715,7 +2349,8 @@ command_t parseMultipleSelect(char* command, table_t* table){
     R = strtol(&endptr2[1], &endptr, 10);
     if(R < 1){
         if(!strncmp(endptr2, ",-,", 3)){
-            select.R2 = table->len;
+            select.R2 = 0;
+            cmd.ends |= SEL_LAST_ROW;
             endptr = &endptr2[2];
         }
         else return cmd;
@@ -725,22 +2360,24 @@ command_t parseMultipleSelect(char* command, table_t* table){
     R = strtol(&endptr[1], &endptr2, 10);
     if(R < 1){
         if(!strncmp(endptr, ",-]", 3)){
-            select.C2 = table->rows[0]->len;
+            select.C2 = 0;
+            cmd.ends |= SEL_LAST_COL;
         }
         else return cmd;
     }
     else select.C2 = R;
 
-    //check if selection is valid
-    if(select.R1 > select.R2 || select.C1 > select.C2) return cmd;
+    //check if selection is valid, ends of the table are checked once it's read
+    if((!(cmd.ends & SEL_LAST_ROW) && select.R1 > select.R2) ||
+        (!(cmd.ends & SEL_LAST_COL) && select.C1 > select.C2)) return cmd;
     cmd.name = SELECTION;
     cmd.selection = select;
     return cmd;
 }
 
 //parse selection commands
-command_t parseSelection(char* command, table_t* table){
-    command_t selector;
+command_t parseSelection(char* command){
+    command_t selector = {0};
     selector.name = UNKNOWN;
     selector.str = NULL;
     //check for closing bracket
@@ -750,13 +2387,28 @@ command_t parseSelection(char* command, table_t* table){
     if(!strncmp(command, "[find ", strlen("[find "))){
         char* newStr = calloc(strlen(&command[strlen("[find ")]), sizeof(char));
         if(newStr == NULL) return selector;
-        strncpy(newStr, &command[strlen("[find ")], strlen(&command[strlen("[find ")]) - 1);
+        memcpy(newStr, &command[strlen("[find ")], strlen(&command[strlen("[find ")]) - 1);
         selector.str = parseStr(newStr);
         free(newStr);
         if(selector.str == NULL) return selector;
         selector.name = SELECTION_FIND;
         return selector;
     }
+    //lookup command, save collumn and string argument
+    if(!strncmp(command, "[lookup ", strlen("[lookup "))){
+        char* endptr;
+        long C = strtol(&command[strlen("[lookup ")], &endptr, 10);
+        if(C < 1 || C > __INT_MAX__ || endptr[0] != ' ') return selector;
+        char* newStr = calloc(strlen(&endptr[1]), sizeof(char));
+        if(newStr == NULL) return selector;
+        memcpy(newStr, &endptr[1], strlen(&endptr[1]) - 1);
+        selector.str = parseStr(newStr);
+        free(newStr);
+        if(selector.str == NULL) return selector;
+        selector.var = C;
+        selector.name = SELECTION_LOOKUP;
+        return selector;
+    }
     //count commas in command, parse single or multiple cell selection
     int commaCount = 0;
     for(char* i = command; i < closeBracket; i++){
@@ -764,10 +2416,10 @@ command_t parseSelection(char* command, table_t* table){
     }
     switch(commaCount){
         case 1:
-            selector = parseSingleSelect(command, table);
+            selector = parseSingleSelect(command);
             break;
         case 3:
-            selector = parseMultipleSelect(command, table);
+            selector = parseMultipleSelect(command);
             break;
     }
     return selector;
@@ -798,6 +2450,15 @@ int parseVar(char* command){
     return X;
 }
 
+//parses the count argument of row and collumn insertions
+int parseCount(char* command){
+    char* endptr;
+    int X = strtol(command, &endptr, 10);
+    if(X < 1) return -1;
+    if(strcmp(endptr, "")) return -1;
+    return X;
+}
+
 //parses and saves flow control commands
 int parseControlVar(char* command, int type, int* var1, int* var2){
     char* endptr;
@@ -835,10 +2496,17 @@ int parseControlVar(char* command, int type, int* var1, int* var2){
 
 //parses and saves commands with arguments
 command_t parseCmdWithArg(char* command){
-    command_t cmd;
+    command_t cmd = {0};
     cmd.name = UNKNOWN;
     cmd.str = NULL;
-    if(!strncmp(command, "set ", 4)){
+    if(!strncmp(command, "irow ", 5) || !strncmp(command, "arow ", 5) ||
+        !strncmp(command, "icol ", 5) || !strncmp(command, "acol ", 5)){
+        cmd.var = parseCount(&command[5]);
+        if(cmd.var < 0) return cmd;
+        if(command[1] == 'r') cmd.name = command[0] == 'i' ? IROW : AROW;
+        else cmd.name = command[0] == 'i' ? ICOL : ACOL;
+    }
+    else if(!strncmp(command, "set ", 4)){
         cmd.str = parseStr(&command[4]);
         if(cmd.str == NULL) return cmd;
         cmd.name = SET_STR;
@@ -906,15 +2574,34 @@ command_t parseCmdWithArg(char* command){
         cmd.var2 = var2;
         cmd.name = SUB;
     }
+    else if(!strncmp(command, "filter ", 7)){
+        char* endptr;
+        long C = strtol(&command[7], &endptr, 10);
+        if(C < 1 || C > __INT_MAX__ || endptr[0] != ' ') return cmd;
+        endptr++;
+        for(int op = 0; op < FILTER_COUNT; op++){
+            int opLen = strlen(filterOps[op]);
+            if(!strncmp(endptr, filterOps[op], opLen) && endptr[opLen] == ' '){
+                cmd.str = parseStr(&endptr[opLen + 1]);
+                if(cmd.str == NULL) return cmd;
+                cmd.var = C;
+                cmd.var2 = op;
+                cmd.name = FILTER;
+                break;
+            }
+        }
+    }
 
     return cmd;
 }
 
 //parses command, calls other functions to parse arguments, saves commands with no arguments
-command_t parseCommand(char* command, table_t* table){
-    command_t cmd;
+command_t parseCommand(char* command){
+    command_t cmd = {0};
     cmd.str = NULL;
     cmd.name = UNKNOWN;
+    //row and collumn insertions without a count insert one
+    cmd.var = 1;
     if(!strcmp(command, "irow")) cmd.name = IROW;
     else if(!strcmp(command, "icol")) cmd.name = ICOL;
     else if(!strcmp(command, "drow")) cmd.name = DROW;
@@ -926,8 +2613,11 @@ command_t parseCommand(char* command, table_t* table){
     else if(!strcmp(command, "[max]")) cmd.name = SELECTION_MAX;
     else if(!strcmp(command, "[_]")) cmd.name = SELECTION_RESTORE;
     else if(!strcmp(command, "clear")) cmd.name = CLEAR;
+    else if(!strcmp(command, "foreach rows")) cmd.name = FOREACH_ROWS;
+    else if(!strcmp(command, "foreach cells")) cmd.name = FOREACH_CELLS;
+    else if(!strcmp(command, "end")) cmd.name = END_EACH;
     else if(command[0] == '['){
-        cmd = parseSelection(command, table);
+        cmd = parseSelection(command);
     }
     else{
         cmd = parseCmdWithArg(command);
@@ -935,377 +2625,2647 @@ command_t parseCommand(char* command, table_t* table){
     return cmd;
 }
 
-//parses all entered commands, returns them in array
-command_t* parseCommands(char* commands, table_t* table, int* cmdCount){
-    int count = 0;
-    command_t* cmds = NULL;
-    char* cmdStr = strtok(commands, ";");
-    while(cmdStr != NULL){
-        count++;
-        command_t* newCmd = realloc(cmds, sizeof(command_t) * count);
-        if(newCmd == NULL){
-            if(commands != NULL) free(commands);
-            fprintf(stderr, "Command memory allocation failed\n");
-            return NULL;
-        }
-        cmds = newCmd;
-        cmds[count - 1] = parseCommand(cmdStr, table);
-        if(cmds[count - 1].name == UNKNOWN){
+//parses the command of len characters at text and appends it to the list
+int appendCommand(cmdList_t* list, const char* text, int len, parseBuf_t* buf){
+    if(list->len == list->allocLen){
+        int newAllocLen = list->allocLen == 0 ? 64 : list->allocLen * 2;
+        command_t* newCmds = realloc(list->cmds, newAllocLen * sizeof(command_t));
+        if(newCmds == NULL) return PARSE_ALLOC;
+        list->cmds = newCmds;
+        list->allocLen = newAllocLen;
+    }
+    //the command is parsed from a terminated copy
+    buf->len = 0;
+    if(appendToBuf(buf, text, len) || appendToBuf(buf, "", 1)) return PARSE_ALLOC;
+    command_t cmd = parseCommand(buf->text);
+    if(cmd.name == UNKNOWN) return PARSE_SYNTAX;
+    list->cmds[list->len++] = cmd;
+    return PARSE_OK;
+}
+
+//splits size characters of text into commands ending at ; (or a newline if
+//lines is set) and parses them, empty commands are skipped, a bad command in
+//a script is reported with its line and collumn
+int splitCommands(const char* text, size_t size, bool lines, const char* script,
+    command_t** cmds, int* cmdCount){
+    cmdList_t list = {NULL, 0, 0};
+    parseBuf_t buf = {NULL, 0, 0};
+    const char* end = text + size;
+    const char* lineStart = text;
+    int line = 1, err = PARSE_OK;
+    for(const char* p = text; p < end && err == PARSE_OK; p++){
+        //commands in scripts can be indented
+        while(lines && p < end && (*p == ' ' || *p == '\t')) p++;
+        const char* start = p;
+        while(p < end && *p != ';' && !(lines && *p == '\n')) p++;
+        int len = p - start;
+        //lines of scripts saved on windows end with \r\n
+        if(lines && len > 0 && start[len - 1] == '\r' && (p == end || *p == '\n')) len--;
+        if(len > 0) err = appendCommand(&list, start, len, &buf);
+        if(err == PARSE_SYNTAX){
+            if(script != NULL) fprintf(stderr, "%s:%d:%d: ", script, line, (int)(start - lineStart) + 1);
             fprintf(stderr, "Invalid command syntax\n");
-            free(cmds);
-            return NULL;
         }
-        cmdStr = strtok(NULL, ";");
+        else if(err == PARSE_ALLOC) fprintf(stderr, "Command memory allocation failed\n");
+        if(p < end && *p == '\n'){
+            line++;
+            lineStart = p + 1;
+        }
+        if(p == end) break;
+    }
+    free(buf.text);
+    if(err != PARSE_OK){
+        freeCmds(list.cmds, list.len);
+        return EXIT_FAILURE;
     }
-    *cmdCount = count;
-    return cmds;
+    *cmds = list.cmds;
+    *cmdCount = list.len;
+    return EXIT_SUCCESS;
 }
 
-//saves a number from cell on [R,C] to out, returns EXIT_SUCCESS if the cell
-//contains only a number, EXIT_FAILURE if not
-int getNumInCell(table_t* table, int R, int C, double* out){
-    if(table->len <= R || table->rows[0]->len <= C) return EXIT_FAILURE;
-    if(!strcmp(CELL(R, C), "")) return EXIT_FAILURE;
-    char* endptr;
-    *out = strtod(CELL(R, C), &endptr);
-    if(strcmp(endptr, "")) return EXIT_FAILURE;
-    return EXIT_SUCCESS;
+//parses all entered commands into an array
+int parseCommands(const char* commands, command_t** cmds, int* cmdCount){
+    return splitCommands(commands, strlen(commands), false, NULL, cmds, cmdCount);
 }
 
-//returns selection to first cell in current selection that contains command.str,
-//returns selection to 0,0 if the string is not found in current selection
-selection_t find(command_t command, table_t* table){
-    for(int i = table->selection.R1; i <= table->selection.R2; i++){
-        for(int j = table->selection.C1; j <= table->selection.C2; j++){
-            if(strstr(CELL(i - 1, j - 1), command.str) != NULL){
-                //string found
-                selection_t out = {i, j, i, j};
-                return out;
-            }
+//sets the selection ends given as _ or - to the size of a table with rows
+//and cols and checks the selections are still valid
+int resolveSelections(command_t* cmds, int cmdCount, int rows, int cols){
+    for(int k = 0; k < cmdCount; k++){
+        selection_t* sel = &cmds[k].selection;
+        if(cmds[k].ends & SEL_LAST_ROW) sel->R2 = rows;
+        if(cmds[k].ends & SEL_LAST_COL) sel->C2 = cols;
+        if(cmds[k].ends && (sel->R1 > sel->R2 || sel->C1 > sel->C2)){
+            fprintf(stderr, "Invalid command syntax\n");
+            return EXIT_FAILURE;
         }
     }
-    //string not found
-    selection_t out = {0, 0, 0, 0};
-    return out;
+    return EXIT_SUCCESS;
 }
 
-//returns selection to a cell with the min or max number, if no numbers are found,
-//returns selection to 0,0
-selection_t minMax(table_t* table, bool minOrMax){
-    double num = minOrMax ? __DBL_MAX__ : __DBL_MIN__;
-    selection_t selection = {0, 0, 0, 0};
-    for(int i = table->selection.R1; i <= table->selection.R2; i++){
-        for(int j = table->selection.C1; j <= table->selection.C2; j++){
-            double tmp;
-            if(!getNumInCell(table, i - 1, j - 1, &tmp)){
-                if(minOrMax){
-                    if(tmp < num){
-                        num = tmp;
-                        selection.R1 = i; selection.R2 = i;
-                        selection.C1 = j; selection.C2 = j;
-                    } 
-                }
-                else{
-                    if(tmp > num){
-                        num = tmp;
-                        selection.R1 = i; selection.R2 = i;
-                        selection.C1 = j; selection.C2 = j;
-                    } 
-                }
-            }
+//returns how many first collumns of the table the commands can use, 0 if
+//that can't be told, selections ending at the last collumn can use all of
+//them and deleting collumns moves the ones after them into reach
+int usedCollumns(command_t* cmds, int cmdCount){
+    //the first cell is selected at the start
+    int used = 1;
+    for(int k = 0; k < cmdCount; k++){
+        command_t* cmd = &cmds[k];
+        int C = 0;
+        switch(cmd->name){
+            case SELECTION:
+                if(cmd->ends & SEL_LAST_COL) return 0;
+                C = cmd->selection.C2;
+                break;
+            case SWAP: case SUM: case AVG: case COUNT: case LEN:
+                C = cmd->selection.C2;
+                break;
+            case SELECTION_LOOKUP: case FILTER:
+                C = cmd->var;
+                break;
+            case DCOL:
+                return 0;
         }
+        if(C > used) used = C;
     }
-    return selection;
+    return used;
 }
 
-//sets the content of cells in selection to str
-int setStr(table_t* table, char* str, selection_t selection){
-    for(int i = selection.R1 - 1; i < selection.R2; i++){
-        for(int j = selection.C1 - 1; j < selection.C2; j++){
-            if(expandTable(table, i, j)){
-                fprintf(stderr, "Memory allocation failure\n");
-                return EXIT_FAILURE;
-            }
-            int len = strlen(str);
-            char* newContent = realloc(CELL(i, j), (len + 1) * sizeof(char));
-            if(len != 0 && newContent == NULL){
-                fprintf(stderr, "Memory allocation failure\n");
-                return EXIT_FAILURE;
-            }
-            CELL(i, j) = newContent;
-            strcpy(CELL(i, j), str);
-            table->rows[i]->cells[j]->len = len + 1;
+//checks if the commands change every row the same way without looking at the
+//other rows, so the table can be edited one row at a time
+bool rowLocal(command_t* cmds, int cmdCount){
+    //the first cell is selected at the start
+    if(cmdCount == 0 || cmds[0].name != SELECTION) return false;
+    for(int k = 0; k < cmdCount; k++){
+        switch(cmds[k].name){
+            case SELECTION:
+                //only selections of whole collumns
+                if(cmds[k].selection.R1 != 1 || !(cmds[k].ends & SEL_LAST_ROW)) return false;
+                break;
+            case SET_STR: case CLEAR: case ICOL: case ACOL: case DCOL:
+                break;
+            default:
+                return false;
         }
     }
-    return EXIT_SUCCESS;
+    return true;
 }
 
-//swaps all cells in table.selection with cell in selection
-int swap(table_t* table, selection_t selection){
-    cell_t* tmp;
-    //save temporary shorter variables for readability
-    int sR1 = selection.R1; int sC1 = selection.C1;
-    int tR1 = table->selection.R1; int tR2 = table->selection.R2;
-    int tC1 = table->selection.C1; int tC2 = table->selection.C2;
+//FNV-1a hash of len bytes
+uint64_t hashBytes(const char* bytes, size_t len){
+    uint64_t hash = 14695981039346656037ULL;
+    for(size_t i = 0; i < len; i++){
+        hash ^= (unsigned char)bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
 
-    //if selection isn't in table, expand it
-    if(expandTable(table, sR1 > tR2 ? sR1 : tR2, sC1 > tC2 ? sC1 : tC2)){
-        fprintf(stderr, "Memory allocation failure\n");
-        return EXIT_FAILURE;
+//saves the path of the cached script with the hash into path, the cache is
+//in SPS_CACHE_DIR or ~/.cache/sps, returns EXIT_FAILURE if there is none,
+//the directory is only made once a script is written into it
+int cachePath(uint64_t hash, char* path){
+    char* dir = getenv("SPS_CACHE_DIR");
+    char* home = getenv("HOME");
+    int len;
+    if(dir != NULL){
+        //an empty SPS_CACHE_DIR turns the cache off
+        if(dir[0] == 0) return EXIT_FAILURE;
+        len = snprintf(path, PATH_SIZE, "%s/%016llx", dir, (unsigned long long)hash);
     }
+    else if(home != NULL && home[0] != 0){
+        len = snprintf(path, PATH_SIZE, "%s/.cache/sps/%016llx", home, (unsigned long long)hash);
+    }
+    else return EXIT_FAILURE;
+    return len < 0 || len >= PATH_SIZE - 32 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
 
-    for(int i = tR1 - 1; i < tR2; i++){
-        for(int j = tC1 - 1; j < tC2; j++){
-            tmp = table->rows[i]->cells[j];
-            table->rows[i]->cells[j] = table->rows[sR1 - 1]->cells[sC1 - 1];
-            table->rows[sR1 - 1]->cells[sC1 - 1] = tmp;
-        }
+//makes the directory holding path and the ones above it that are missing
+void makeParents(char* path){
+    char* slash = strrchr(path, '/');
+    if(slash == NULL || slash == path) return;
+    *slash = 0;
+    if(mkdir(path, 0755) && errno == ENOENT){
+        makeParents(path);
+        mkdir(path, 0755);
     }
+    *slash = '/';
+}
 
-    return EXIT_SUCCESS;
+//orders cache files from the most recently used one
+int newerCacheFile(const void* a, const void* b){
+    time_t x = ((const cacheFile_t*)a)->mtime, y = ((const cacheFile_t*)b)->mtime;
+    return x > y ? -1 : x < y;
 }
 
-//saves a number as a string into cell in selection
-int printNumToCell(table_t* table, selection_t selection, double num){
-    //find the length of outputed number
-    int bufsz = snprintf(NULL, 0, "%g", num);
-    //allocate memory for temporary buffer
-    char* outStr = malloc((bufsz + 1) * sizeof(char));
-    if(outStr == NULL){
-        fprintf(stderr, "Memory allocation failure\n");
-        return EXIT_FAILURE;
+//deletes the scripts in the directory of the cache file path that are too
+//old or don't fit in the cache, a hit touches its file, so the mtime of
+//every file is when it was last used
+void pruneCache(const char* path){
+    char dirPath[PATH_SIZE];
+    snprintf(dirPath, PATH_SIZE, "%s", path);
+    char* written = strrchr(dirPath, '/');
+    *written++ = 0;
+    DIR* dir = opendir(dirPath);
+    if(dir == NULL) return;
+    cacheFile_t* files = NULL;
+    int len = 0, allocLen = 0;
+    time_t now = time(NULL);
+    struct dirent* entry;
+    while((entry = readdir(dir)) != NULL){
+        //only the scripts are in the cache, named by their hash, the one just
+        //written always stays
+        if(strlen(entry->d_name) != 16 || strspn(entry->d_name, "0123456789abcdef") != 16 ||
+            !strcmp(entry->d_name, written)) continue;
+        struct stat st;
+        if(fstatat(dirfd(dir), entry->d_name, &st, 0)) continue;
+        if(now - st.st_mtime > CACHE_MAX_AGE){
+            unlinkat(dirfd(dir), entry->d_name, 0);
+            continue;
+        }
+        if(len == allocLen){
+            cacheFile_t* tmp = realloc(files, (allocLen * 2 + 16) * sizeof(cacheFile_t));
+            if(tmp == NULL) break;
+            files = tmp;
+            allocLen = allocLen * 2 + 16;
+        }
+        snprintf(files[len].name, sizeof(files[len].name), "%s", entry->d_name);
+        files[len].mtime = st.st_mtime;
+        files[len].size = st.st_size;
+        len++;
     }
-    //print in the buffer and put it in the selected cell
-    sprintf(outStr, "%g", num);
-    if(setStr(table, outStr, selection)){
-        fprintf(stderr, "Memory allocation failure\n");
-        free(outStr);
-        return EXIT_FAILURE;
+    if(len > 0) qsort(files, len, sizeof(cacheFile_t), newerCacheFile);
+    struct stat st;
+    off_t size = fstatat(dirfd(dir), written, &st, 0) ? 0 : st.st_size;
+    for(int i = 0; i < len; i++){
+        size += files[i].size;
+        if(size > CACHE_MAX_SIZE) unlinkat(dirfd(dir), files[i].name, 0);
     }
-    free(outStr);
-    return EXIT_SUCCESS;
+    closedir(dir);
+    free(files);
 }
 
-//gets the sum or average of numbers in table.selection and saves it in the
-//cell from selection
-int sumAvg(table_t* table, selection_t selection, bool isAvg){
-    double sum = 0;
-    int count = 0;
-    for(int i = table->selection.R1 - 1; i < table->selection.R2; i++){
-        for(int j = table->selection.C1 - 1; j < table->selection.C2; j++){
-            double num;
-            if(!getNumInCell(table, i, j, &num)){
+//checks the arguments of command k read from the cache are ones parseCommands
+//could have given it, the cache file may be damaged or written by anyone
+bool validCommand(command_t* cmd, int k){
+    selection_t* sel = &cmd->selection;
+    bool hasStr = cmd->name == SET_STR || cmd->name == SELECTION_FIND ||
+        cmd->name == SELECTION_LOOKUP || cmd->name == FILTER;
+    if(cmd->name <= UNKNOWN || cmd->name >= SEL_SET || hasStr != (cmd->str != NULL)) return false;
+    if(cmd->name != SELECTION && cmd->ends != 0) return false;
+    switch(cmd->name){
+        case SELECTION:
+            if(cmd->ends & ~(SEL_LAST_ROW | SEL_LAST_COL) || sel->R1 < 1 || sel->C1 < 1) return false;
+            if(!(cmd->ends & SEL_LAST_ROW) && sel->R2 < sel->R1) return false;
+            if(!(cmd->ends & SEL_LAST_COL) && sel->C2 < sel->C1) return false;
+            return true;
+        case SWAP: case SUM: case AVG: case COUNT: case LEN:
+            return sel->R1 >= 1 && sel->R2 == sel->R1 && sel->C1 >= 1 && sel->C2 == sel->C1;
+        case IROW: case AROW: case ICOL: case ACOL: case SELECTION_LOOKUP:
+            return cmd->var >= 1;
+        case FILTER:
+            return cmd->var >= 1 && cmd->var2 >= 0 && cmd->var2 < FILTER_COUNT;
+        case DEF_TEMP: case USE_TEMP: case INC_TEMP:
+            return cmd->var >= 0 && cmd->var <= 9;
+        case SUB:
+            return cmd->var >= 0 && cmd->var <= 9 && cmd->var2 >= 0 && cmd->var2 <= 9;
+        //the jump target of both has to fit an int
+        case ISZERO:
+            if(cmd->var < 0 || cmd->var > 9) return false;
+            //fall through
+        case GOTO:{
+            long target = (long)k + (cmd->name == GOTO ? cmd->var : cmd->var2) + 1;
+            return target >= -__INT_MAX__ - 1L && target <= __INT_MAX__;
+        }
+        default:
+            return true;
+    }
+}
+
+//loads the commands of the script with the hash and size from the cache,
+//returns EXIT_FAILURE if the cache doesn't hold a usable copy
+int readCache(const char* path, uint64_t hash, const char* script, uint64_t size, command_t** cmds, int* cmdCount){
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) || st.st_size < (off_t)sizeof(cacheHeader_t)){
+        if(fd >= 0) close(fd);
+        return EXIT_FAILURE;
+    }
+    char* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED) return EXIT_FAILURE;
+    const char* end = data + st.st_size;
+
+    cacheHeader_t header;
+    memcpy(&header, data, sizeof(header));
+    cmdList_t list = {NULL, 0, 0};
+    bool ok = !memcmp(header.magic, "SPSC", 4) && header.version == CACHE_VERSION &&
+        header.opCount == OP_COUNT && header.hash == hash && header.size == size &&
+        size <= (uint64_t)st.st_size - sizeof(header) && !memcmp(data + sizeof(header), script, size) &&
+        header.count >= 0 && header.count <= (st.st_size - (off_t)sizeof(header) - (off_t)size) / (off_t)sizeof(cacheCmd_t);
+    if(ok && header.count > 0){
+        list.cmds = malloc(header.count * sizeof(command_t));
+        ok = list.cmds != NULL;
+    }
+    const char* p = data + sizeof(header) + (ok ? size : 0);
+    while(ok && list.len < header.count){
+        cacheCmd_t rec;
+        if(end - p < (long)sizeof(rec)){
+            ok = false;
+            break;
+        }
+        memcpy(&rec, p, sizeof(rec));
+        p += sizeof(rec);
+        command_t cmd = {rec.name, NULL, rec.var, rec.var2, {rec.R1, rec.C1, rec.R2, rec.C2}, rec.ends};
+        if(rec.strLen >= 0){
+            if(end - p < rec.strLen || (cmd.str = malloc(rec.strLen + 1)) == NULL){
+                ok = false;
+                break;
+            }
+            memcpy(cmd.str, p, rec.strLen);
+            cmd.str[rec.strLen] = 0;
+            p += rec.strLen;
+        }
+        //one bad record throws the whole cache away, the script is parsed again
+        if(!validCommand(&cmd, list.len)){
+            free(cmd.str);
+            ok = false;
+            break;
+        }
+        list.cmds[list.len++] = cmd;
+    }
+    munmap(data, st.st_size);
+    if(!ok){
+        freeCmds(list.cmds, list.len);
+        return EXIT_FAILURE;
+    }
+    //the script was used now, so it's the last one to leave the cache
+    utimensat(AT_FDCWD, path, NULL, 0);
+    *cmds = list.cmds;
+    *cmdCount = list.len;
+    return EXIT_SUCCESS;
+}
+
+//saves the script and its parsed commands into the cache, the file is
+//written under a temporary name and renamed, so a reader never sees it half
+//written, a cache that can't be written is only slower
+void writeCache(const char* path, uint64_t hash, const char* script, uint64_t size, command_t* cmds, int cmdCount){
+    char tmpPath[PATH_SIZE];
+    snprintf(tmpPath, PATH_SIZE, "%s.%ld.tmp", path, (long)getpid());
+    makeParents(tmpPath);
+    FILE* file = fopen(tmpPath, "wb");
+    if(file == NULL) return;
+    cacheHeader_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "SPSC", 4);
+    header.version = CACHE_VERSION;
+    header.opCount = OP_COUNT;
+    header.count = cmdCount;
+    header.hash = hash;
+    header.size = size;
+    bool err = fwrite(&header, sizeof(header), 1, file) != 1 ||
+        (size > 0 && fwrite(script, size, 1, file) != 1);
+    for(int i = 0; i < cmdCount && !err; i++){
+        command_t* cmd = &cmds[i];
+        cacheCmd_t rec = {cmd->name, cmd->var, cmd->var2, cmd->ends, cmd->selection.R1,
+            cmd->selection.C1, cmd->selection.R2, cmd->selection.C2, cmd->str == NULL ? -1 : (int)strlen(cmd->str)};
+        err = fwrite(&rec, sizeof(rec), 1, file) != 1 ||
+            (rec.strLen > 0 && fwrite(cmd->str, rec.strLen, 1, file) != 1);
+    }
+    if(fclose(file) || err || rename(tmpPath, path)) unlink(tmpPath);
+    else pruneCache(path);
+}
+
+//reads and parses the commands of a script file, ; and newlines both end a
+//command, scripts run before are loaded from the cache instead
+int loadScript(const char* script, command_t** cmds, int* cmdCount){
+    int fd = open(script, O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st)){
+        if(fd >= 0) close(fd);
+        fprintf(stderr, "Error while reading script\n");
+        return EXIT_FAILURE;
+    }
+    char* data = "";
+    if(st.st_size > 0 && (data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED){
+        close(fd);
+        fprintf(stderr, "Error while reading script\n");
+        return EXIT_FAILURE;
+    }
+    close(fd);
+
+    uint64_t hash = hashBytes(data, st.st_size);
+    char path[PATH_SIZE];
+    bool cache = !cachePath(hash, path);
+    int err = EXIT_SUCCESS;
+    if(!cache || readCache(path, hash, data, st.st_size, cmds, cmdCount)){
+        err = splitCommands(data, st.st_size, true, script, cmds, cmdCount);
+        if(!err && cache) writeCache(path, hash, data, st.st_size, *cmds, *cmdCount);
+    }
+    if(st.st_size > 0) munmap(data, st.st_size);
+    return err;
+}
+
+//makes rows of a snapshot into rows of the table, the text of their cells
+//has to lie between the heap offsets of the rows
+void* snapRows(void* arg){
+    snapJob_t* job = arg;
+    table_t* table = job->table;
+    const char* heapEnd = job->heap + job->header->heapLen;
+    int64_t k = job->firstCell;
+    for(int i = job->R1; i < job->R2 && !job->err; i++){
+        const snapRow_t* rec = &job->rows[i];
+        const char* p = job->heap + rec->heap;
+        const char* end = i + 1 < job->header->rows ? job->heap + job->rows[i + 1].heap : heapEnd;
+        row_t* row = row_ctor();
+        if(row == NULL || openCells(row, 0, rec->cells)){
+            if(row != NULL) freeRow(row);
+            job->err = true;
+            break;
+        }
+        ROW_SLOT(i) = row;
+        job->made++;
+        for(int j = 0; j < rec->cells; j++, k++){
+            const char* text = memchr(p, 0, end - p);
+            if(text == NULL){
+                //the rest of the row's cells hold nothing to free
+                row->len = j;
+                job->err = true;
+                break;
+            }
+            cell_t* cell = &job->block[k];
+            cell->content = (char*)p;
+            cell->len = text - p + 1;
+            //the snapshot holds one reference, so no slot frees the cell
+            cell->refs = 2;
+            cell->numState = NUM_UNKNOWN;
+            cell->plain = false;
+            CELLP(row, j) = cell;
+            p = text + 1;
+        }
+        if(rec->offset >= 0){
+            row->text = job->source + rec->offset;
+            row->textLen = rec->textLen;
+            row->textCells = rec->textCells;
+        }
+    }
+    return NULL;
+}
+
+//loads the table from the snapshot of fileName if it was made from the file
+//as it is now, returns EXIT_FAILURE if the file has to be read instead
+int loadSnapshot(table_t* table, const char* fileName){
+    char path[PATH_SIZE];
+    struct stat src, st;
+    if(snprintf(path, PATH_SIZE, "%s.spsnap", fileName) >= PATH_SIZE || stat(fileName, &src) ||
+        src.st_size == 0){
+        return EXIT_FAILURE;
+    }
+    int fd = open(path, O_RDONLY);
+    if(fd < 0 || fstat(fd, &st) || st.st_size < (off_t)sizeof(snapHeader_t)){
+        if(fd >= 0) close(fd);
+        return EXIT_FAILURE;
+    }
+    char* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED) return EXIT_FAILURE;
+
+    //the sections are read in place, the mapping is aligned for them
+    snapHeader_t* header = (snapHeader_t*)data;
+    uint64_t left = st.st_size - sizeof(snapHeader_t);
+    bool ok = !memcmp(header->magic, "SPSS", 4) && header->version == SNAP_VERSION &&
+        header->size == (uint64_t)src.st_size && header->mtime == src.st_mtim.tv_sec &&
+        header->mtimeNsec == src.st_mtim.tv_nsec &&
+        header->delimHash == hashBytes(table->delim, strlen(table->delim)) &&
+        header->rows > 0 && header->rows <= __INT_MAX__ && header->cells >= 0 &&
+        header->nums >= 0 && header->heapLen >= 0 && (uint64_t)header->rows <= left / sizeof(snapRow_t);
+    if(ok){
+        left -= header->rows * sizeof(snapRow_t);
+        ok = (uint64_t)header->nums <= left / sizeof(snapNum_t) &&
+            (uint64_t)header->heapLen == left - header->nums * sizeof(snapNum_t);
+    }
+    const snapRow_t* rows = (snapRow_t*)(data + sizeof(snapHeader_t));
+    const snapNum_t* nums = (snapNum_t*)(rows + (ok ? header->rows : 0));
+    const char* heap = (const char*)(nums + (ok ? header->nums : 0));
+    //rows have to point inside the file and the heap in order
+    int64_t cells = 0;
+    for(int64_t i = 0; ok && i < header->rows; i++){
+        const snapRow_t* rec = &rows[i];
+        ok = rec->cells >= 0 && rec->cells <= header->cells - cells && rec->heap >= 0 &&
+            rec->heap <= (i + 1 < header->rows ? rows[i + 1].heap : header->heapLen) &&
+            (rec->offset < 0 || (rec->textLen >= 0 && rec->textCells >= 1 &&
+            (uint64_t)rec->offset + rec->textLen <= (uint64_t)src.st_size));
+        cells += rec->cells;
+    }
+    for(int64_t n = 0; ok && n < header->nums; n++){
+        ok = nums[n].cell >= 0 && nums[n].cell < header->cells;
+    }
+    ok = ok && cells == header->cells;
+
+    //lines of unchanged rows are copied from the file when it's saved
+    size_t size = 0;
+    char* source = ok ? mapFile(fileName, &size) : NULL;
+    cell_t* block = ok ? malloc((header->cells > 0 ? header->cells : 1) * sizeof(cell_t)) : NULL;
+    if(source == NULL || block == NULL || openRows(table, 0, header->rows)){
+        if(source != NULL) munmap(source, size);
+        free(block);
+        munmap(data, st.st_size);
+        return EXIT_FAILURE;
+    }
+
+    //rows are made in parallel blocks
+    int count = threadCount();
+    if(count > header->rows / FORMAT_BATCH) count = header->rows / FORMAT_BATCH;
+    if(count < 1) count = 1;
+    snapJob_t jobs[MAX_THREADS];
+    int64_t firstCell = 0;
+    for(int i = 0, R = 0; i < count; i++){
+        snapJob_t job = {table, header, rows, heap, source, block, R,
+            i == count - 1 ? header->rows : header->rows / count * (i + 1), firstCell, 0, false};
+        jobs[i] = job;
+        for(; R < job.R2; R++) firstCell += rows[R].cells;
+    }
+    runParallel(&table->pool, snapRows, jobs, sizeof(snapJob_t), count);
+    bool err = false;
+    for(int i = 0; i < count; i++) err = err || jobs[i].err;
+    if(err){
+        //undo everything, the file is read instead
+        for(int i = 0; i < count; i++){
+            for(int R = jobs[i].R1; R < jobs[i].R1 + jobs[i].made; R++) freeRow(ROW_SLOT(R));
+        }
+        closeRows(table, 0, header->rows);
+        munmap(source, size);
+        free(block);
+        munmap(data, st.st_size);
+        return EXIT_FAILURE;
+    }
+    for(int64_t n = 0; n < header->nums; n++){
+        block[nums[n].cell].numState = NUM_VALID;
+        block[nums[n].cell].num = nums[n].num;
+    }
+    table->snap = data;
+    table->snapLen = st.st_size;
+    table->snapCells = block;
+    table->source = source;
+    table->sourceLen = size;
+    table->ragged = true;
+    return EXIT_SUCCESS;
+}
+
+//saves a snapshot of the table just written to fileName, the rows are
+//matched to the lines of the file, failures only leave no snapshot
+void writeSnapshot(table_t* table, const char* fileName){
+    char path[PATH_SIZE], tmpPath[PATH_SIZE];
+    struct stat src;
+    if(snprintf(path, PATH_SIZE, "%s.spsnap", fileName) >= PATH_SIZE ||
+        snprintf(tmpPath, PATH_SIZE, "%s.%ld.tmp", path, (long)getpid()) >= PATH_SIZE ||
+        table->len == 0 || stat(fileName, &src)) return;
+    size_t size;
+    char* data = mapFile(fileName, &size);
+    if(data == NULL) return;
+    int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    outBuf_t out = {fd, malloc(OUT_BUF_SIZE), 0, OUT_BUF_SIZE};
+    if(fd < 0 || out.buf == NULL){
+        if(fd >= 0){
+            close(fd);
+            unlink(tmpPath);
+        }
+        free(out.buf);
+        munmap(data, size);
+        return;
+    }
+
+    snapHeader_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "SPSS", 4);
+    header.version = SNAP_VERSION;
+    header.size = src.st_size;
+    header.mtime = src.st_mtim.tv_sec;
+    header.mtimeNsec = src.st_mtim.tv_nsec;
+    header.delimHash = hashBytes(table->delim, strlen(table->delim));
+    header.rows = table->len;
+    bool err = false;
+    for(int i = 0; i < table->len && !err; i++){
+        row_t* row = ROW(i);
+        //collumns kept as text need cells of their own
+        if(row->tail != NULL) err = expandTail(table, row, 0, row->len);
+        for(int j = 0; j < row->len; j++){
+            if(CELLP(row, j)->numState == NUM_VALID) header.nums++;
+        }
+    }
+    err = err || putBytes(&out, (char*)&header, sizeof(header));
+
+    //every row is one line of the file
+    const char* p = data, *end = data + size;
+    for(int i = 0; i < table->len && !err; i++){
+        row_t* row = ROW(i);
+        const char* lineEnd = memchr(p, '\n', end - p);
+        if(lineEnd == NULL) lineEnd = end;
+        lineInfo_t info;
+        snapRow_t rec = {-1, header.heapLen, 0, 0, row->len, 0};
+        if(measureLine(p, lineEnd, table->charClass, table->delim[0], &info) != NULL && info.verbatim){
+            rec.offset = p - data;
+            rec.textLen = lineEnd - p;
+            rec.textCells = info.cells;
+        }
+        for(int j = 0; j < row->len; j++){
+            char tmp[NUM_TEXT_SIZE];
+            header.heapLen += strlen(cellText(CELLP(row, j), tmp)) + 1;
+        }
+        err = putBytes(&out, (char*)&rec, sizeof(rec));
+        p = lineEnd < end ? lineEnd + 1 : end;
+    }
+    for(int i = 0; i < table->len && !err; i++){
+        row_t* row = ROW(i);
+        for(int j = 0; j < row->len && !err; j++){
+            snapNum_t rec = {header.cells++, CELLP(row, j)->num};
+            if(CELLP(row, j)->numState == NUM_VALID) err = putBytes(&out, (char*)&rec, sizeof(rec));
+        }
+    }
+    for(int i = 0; i < table->len && !err; i++){
+        row_t* row = ROW(i);
+        for(int j = 0; j < row->len && !err; j++){
+            char tmp[NUM_TEXT_SIZE];
+            const char* text = cellText(CELLP(row, j), tmp);
+            err = putBytes(&out, text, strlen(text) + 1);
+        }
+    }
+    err = err || flushOut(&out) || pwrite(fd, &header, sizeof(header), 0) != sizeof(header);
+    free(out.buf);
+    munmap(data, size);
+    if(close(fd) || err || rename(tmpPath, path)) unlink(tmpPath);
+}
+
+//saves the state of the cell in row R of the numeric column
+void setColumnRow(column_t* column, int R, cell_t* cell){
+    uint64_t bit = (uint64_t)1 << (R % 64);
+    double num;
+    if(!cellNum(cell, &num)){
+        column->num[R] = num;
+        column->isNum[R / 64] |= bit;
+    }
+    else{
+        column->num[R] = NAN;
+        column->isNum[R / 64] &= ~bit;
+    }
+    if(cellEmpty(cell)) column->nonEmpty[R / 64] &= ~bit;
+    else column->nonEmpty[R / 64] |= bit;
+}
+
+//splits the rows of sel into stripes ending at multiples of STRIPE_ROWS and
+//runs fn on all of them, the stripes don't depend on the number of threads,
+//so combining their results in order gives the same result every time,
+//returns the stripes or NULL on allocation failure
+stripe_t* runStripes(table_t* table, stripe_t sel, void* (*fn)(void*), int* count){
+    int first = sel.R1 / STRIPE_ROWS;
+    *count = sel.R2 > sel.R1 ? (sel.R2 - 1) / STRIPE_ROWS - first + 1 : 0;
+    stripe_t* stripes = malloc((*count > 0 ? *count : 1) * sizeof(stripe_t));
+    if(stripes == NULL) return NULL;
+    for(int k = 0; k < *count; k++){
+        stripes[k] = sel;
+        if(k > 0) stripes[k].R1 = (first + k) * STRIPE_ROWS;
+        if(k < *count - 1) stripes[k].R2 = (first + k + 1) * STRIPE_ROWS;
+    }
+    if(*count > 0) runParallel(&table->pool, fn, stripes, sizeof(stripe_t), *count);
+    return stripes;
+}
+
+//fills rows of a stripe in the numeric column of collumn C1
+void* fillColumnStripe(void* arg){
+    stripe_t* stripe = arg;
+    table_t* table = stripe->table;
+    column_t* column = table->columns[stripe->C1];
+    for(int i = stripe->R1; i < stripe->R2; i++){
+        if(stripe->C1 < ROW(i)->len) setColumnRow(column, i, CELL(i, stripe->C1));
+        else column->num[i] = NAN;
+    }
+    return NULL;
+}
+
+//returns the numeric column for collumn C, builds it if it doesn't exist yet,
+//returns NULL on allocation failure
+column_t* getColumn(table_t* table, int C){
+    if(C >= table->columnsLen){
+        column_t** newColumns = realloc(table->columns, (C + 1) * sizeof(column_t*));
+        if(newColumns == NULL) return NULL;
+        for(int i = table->columnsLen; i <= C; i++) newColumns[i] = NULL;
+        table->columns = newColumns;
+        table->columnsLen = C + 1;
+    }
+    if(table->columns[C] != NULL) return table->columns[C];
+
+    column_t* column = calloc(1, sizeof(column_t));
+    if(column == NULL) return NULL;
+    column->len = table->len;
+    //rounded up to whole bitmap words, the padding is never a number
+    int words = (table->len + 63) / 64;
+    column->num = malloc(words * 64 * sizeof(double));
+    column->isNum = calloc(words, sizeof(uint64_t));
+    column->nonEmpty = calloc(words, sizeof(uint64_t));
+    if(column->num == NULL || column->isNum == NULL || column->nonEmpty == NULL){
+        freeColumn(column);
+        return NULL;
+    }
+    for(int i = table->len; i < words * 64; i++) column->num[i] = NAN;
+    table->columns[C] = column;
+    stripe_t all = {table, 0, table->len, C, C + 1, NULL, NULL, false, 0, 0, 0, -1, -1, EXIT_SUCCESS};
+    int count;
+    stripe_t* stripes = runStripes(table, all, fillColumnStripe, &count);
+    if(stripes == NULL){
+        table->columns[C] = NULL;
+        freeColumn(column);
+        return NULL;
+    }
+    free(stripes);
+    return column;
+}
+
+//updates the numeric column after cell [R,C] was written
+void noteWrite(table_t* table, int R, int C){
+    ROW(R)->text = NULL;
+    if(C < table->columnsLen && table->columns[C] != NULL && R < table->len){
+        setColumnRow(table->columns[C], R, CELL(R, C));
+    }
+}
+
+//returns the mask of rows R1 up to (not including) R2 in bitmap word w
+uint64_t rowMask(int w, int R1, int R2){
+    uint64_t mask = ~(uint64_t)0;
+    if(w == R1 / 64) mask &= ~(uint64_t)0 << (R1 % 64);
+    if(w == (R2 - 1) / 64) mask &= ~(uint64_t)0 >> (63 - (R2 - 1) % 64);
+    return mask;
+}
+
+//adds num to sum and what the addition rounded off to comp (Neumaier), sum +
+//comp keeps the exact total far better than sum alone, so it hardly changes
+//with the order the numbers are added in
+void addComp(double* sum, double* comp, double num){
+    double t = *sum + num;
+    *comp += fabs(*sum) >= fabs(num) ? (*sum - t) + num : (num - t) + *sum;
+    *sum = t;
+}
+
+//returns the compensated sum, infinities and NaN leave comp NaN
+double compSum(double sum, double comp){
+    return isfinite(sum) ? sum + comp : sum;
+}
+
+//sums numbers in rows R1 up to (not including) R2 of the column into sum and
+//comp and counts them, whole words of numbers are summed with four
+//independent compensated accumulators, so their additions can overlap
+void columnSum(column_t* column, int R1, int R2, double* sum, double* comp, int* count){
+    double acc[4] = {0, 0, 0, 0};
+    double err[4] = {0, 0, 0, 0};
+    for(int w = R1 / 64; w <= (R2 - 1) / 64; w++){
+        uint64_t bits = column->isNum[w] & rowMask(w, R1, R2);
+        *count += __builtin_popcountll(bits);
+        const double* num = &column->num[w * 64];
+        if(bits == ~(uint64_t)0){
+            for(int k = 0; k < 64; k += 4){
+                for(int l = 0; l < 4; l++) addComp(&acc[l], &err[l], num[k + l]);
+            }
+        }
+        else{
+            while(bits){
+                addComp(&acc[0], &err[0], num[__builtin_ctzll(bits)]);
+                bits &= bits - 1;
+            }
+        }
+    }
+    for(int l = 0; l < 4; l++){
+        *comp += err[l];
+        addComp(sum, comp, acc[l]);
+    }
+}
+
+//counts non empty cells in rows R1 up to (not including) R2 of the column
+int columnCount(column_t* column, int R1, int R2){
+    int count = 0;
+    for(int w = R1 / 64; w <= (R2 - 1) / 64; w++){
+        count += __builtin_popcountll(column->nonEmpty[w] & rowMask(w, R1, R2));
+    }
+    return count;
+}
+
+//finds the smallest (or biggest) number in rows R1 up to (not including) R2
+//of the column, starting from num, returns the first row holding it or -1 if
+//there is no number past num, cells that aren't numbers hold NaN which never
+//wins a comparison
+int columnBest(column_t* column, int R1, int R2, bool minOrMax, double* num){
+    double acc[4] = {*num, *num, *num, *num};
+    const double* values = column->num;
+    int i = R1;
+    if(minOrMax){
+        for(; i + 4 <= R2; i += 4){
+            for(int k = 0; k < 4; k++) acc[k] = values[i + k] < acc[k] ? values[i + k] : acc[k];
+        }
+        for(; i < R2; i++) acc[0] = values[i] < acc[0] ? values[i] : acc[0];
+        for(int k = 1; k < 4; k++) acc[0] = acc[k] < acc[0] ? acc[k] : acc[0];
+        if(!(acc[0] < *num)) return -1;
+    }
+    else{
+        for(; i + 4 <= R2; i += 4){
+            for(int k = 0; k < 4; k++) acc[k] = values[i + k] > acc[k] ? values[i + k] : acc[k];
+        }
+        for(; i < R2; i++) acc[0] = values[i] > acc[0] ? values[i] : acc[0];
+        for(int k = 1; k < 4; k++) acc[0] = acc[k] > acc[0] ? acc[k] : acc[0];
+        if(!(acc[0] > *num)) return -1;
+    }
+    *num = acc[0];
+    for(i = R1; values[i] != acc[0]; i++);
+    return i;
+}
+
+//returns the row of a and b whose number in the column wins [min] (or [max]),
+//NaN never wins and the lower row wins ties
+int betterRow(column_t* column, bool minOrMax, int a, int b){
+    double x = column->num[a], y = column->num[b];
+    if(isnan(y)) return isnan(x) && b < a ? b : a;
+    if(isnan(x)) return b;
+    if(minOrMax ? x < y : x > y) return a;
+    if(minOrMax ? y < x : y > x) return b;
+    return a < b ? a : b;
+}
+
+//returns the column's segment tree for [min] (or [max]), builds it if it
+//doesn't exist yet, returns NULL on allocation failure
+int* getTree(column_t* column, bool minOrMax){
+    int** tree = minOrMax ? &column->minTree : &column->maxTree;
+    if(*tree != NULL) return *tree;
+    int len = column->len;
+    int* nodes = malloc(2 * len * sizeof(int));
+    if(nodes == NULL) return NULL;
+    for(int i = 0; i < len; i++) nodes[len + i] = i;
+    for(int i = len - 1; i > 0; i--){
+        nodes[i] = betterRow(column, minOrMax, nodes[2 * i], nodes[2 * i + 1]);
+    }
+    *tree = nodes;
+    return nodes;
+}
+
+//free both segment trees of the column
+void dropTrees(column_t* column){
+    free(column->minTree);
+    free(column->maxTree);
+    column->minTree = NULL;
+    column->maxTree = NULL;
+}
+
+//updates the segment trees of the column after the number in row R changed
+void treeWrite(column_t* column, int R){
+    for(int k = 0; k < 2; k++){
+        bool minOrMax = k == 0;
+        int* nodes = minOrMax ? column->minTree : column->maxTree;
+        if(nodes == NULL || R >= column->len) continue;
+        for(int i = (R + column->len) / 2; i > 0; i /= 2){
+            nodes[i] = betterRow(column, minOrMax, nodes[2 * i], nodes[2 * i + 1]);
+        }
+    }
+}
+
+//finds the first row with the smallest (or biggest) number in rows R1 up to
+//(not including) R2 of the column using its segment tree, returns -1 if
+//there are no numbers
+int treeBest(column_t* column, int* nodes, bool minOrMax, int R1, int R2){
+    int best = -1;
+    for(int l = R1 + column->len, r = R2 + column->len; l < r; l /= 2, r /= 2){
+        if(l & 1){
+            best = best < 0 ? nodes[l] : betterRow(column, minOrMax, best, nodes[l]);
+            l++;
+        }
+        if(r & 1){
+            r--;
+            best = best < 0 ? nodes[r] : betterRow(column, minOrMax, best, nodes[r]);
+        }
+    }
+    return best >= 0 && !isnan(column->num[best]) ? best : -1;
+}
+
+//clips selection to the table and turns it into a stripe with 0-based rows
+//R1 up to (not including) R2 and collumns C1 up to C2
+stripe_t clipSelection(table_t* table, selection_t selection){
+    int width = tableWidth(table);
+    stripe_t sel = {table, selection.R1 - 1, selection.R2, selection.C1 - 1, selection.C2,
+        NULL, NULL, false, 0, 0, 0, -1, -1, EXIT_SUCCESS};
+    if(sel.R2 > table->len) sel.R2 = table->len;
+    if(sel.C2 > width) sel.C2 = width;
+    if(sel.R1 > sel.R2) sel.R1 = sel.R2;
+    if(sel.C1 > sel.C2) sel.C1 = sel.C2;
+    return sel;
+}
+
+//checks if table.selection is big enough to be reduced over numeric columns,
+//out is the clipped selection
+bool columnSelection(table_t* table, stripe_t* out){
+    stripe_t sel = clipSelection(table, table->selection);
+    if(sel.R2 - sel.R1 < COLUMN_MIN_ROWS || sel.C1 >= sel.C2) return false;
+    for(int j = sel.C1; j < sel.C2; j++){
+        if(getColumn(table, j) == NULL) return false;
+    }
+    *out = sel;
+    return true;
+}
+
+//sums and counts numbers of a stripe over numeric columns
+void* sumStripe(void* arg){
+    stripe_t* stripe = arg;
+    for(int j = stripe->C1; j < stripe->C2; j++){
+        columnSum(stripe->table->columns[j], stripe->R1, stripe->R2, &stripe->num, &stripe->comp, &stripe->count);
+    }
+    return NULL;
+}
+
+//counts non empty cells of a stripe over numeric columns
+void* countStripe(void* arg){
+    stripe_t* stripe = arg;
+    for(int j = stripe->C1; j < stripe->C2; j++){
+        stripe->count += columnCount(stripe->table->columns[j], stripe->R1, stripe->R2);
+    }
+    return NULL;
+}
+
+//finds the first cell with the smallest (or biggest) number of a stripe over
+//numeric columns, starting from the number already in the stripe
+void* bestStripe(void* arg){
+    stripe_t* stripe = arg;
+    double start = stripe->num;
+    for(int j = stripe->C1; j < stripe->C2; j++){
+        double best = start;
+        int R = columnBest(stripe->table->columns[j], stripe->R1, stripe->R2, stripe->minOrMax, &best);
+        if(R < 0) continue;
+        //the first cell in row-major order wins ties
+        if(stripe->R < 0 || (stripe->minOrMax ? best < stripe->num : best > stripe->num) ||
+            (best == stripe->num && R < stripe->R)){
+            stripe->num = best;
+            stripe->R = R;
+            stripe->C = j;
+        }
+    }
+    return NULL;
+}
+
+//finds the first cell of a stripe containing its string, cells shared by
+//many slots are only searched once
+void* findStripe(void* arg){
+    stripe_t* stripe = arg;
+    table_t* table = stripe->table;
+    //recently searched cells without the string, by their address, cells of
+    //a paged table are freed while searching and their address reused
+    cell_t* missed[FIND_MISSED] = {NULL};
+    bool remember = table->pager == NULL;
+    for(int i = stripe->R1; i < stripe->R2; i++){
+        row_t* row = ROW(i);
+        int C2 = stripe->C2 < row->len ? stripe->C2 : row->len;
+        for(int j = stripe->C1; j < C2; j++){
+            char tmp[NUM_TEXT_SIZE];
+            cell_t* cell = CELLP(row, j);
+            cell_t** slot = &missed[((uintptr_t)cell / sizeof(cell_t)) % FIND_MISSED];
+            if(*slot == cell) continue;
+            if(strstr(cellText(cell, tmp), stripe->str) != NULL){
+                stripe->R = i;
+                stripe->C = j;
+                return NULL;
+            }
+            if(remember) *slot = cell;
+        }
+        //the empty cells past the end of the row only contain ""
+        int C = stripe->C1 > row->len ? stripe->C1 : row->len;
+        if(stripe->str[0] == 0 && C < stripe->C2){
+            stripe->R = i;
+            stripe->C = C;
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+//counts the characters in cells of a stripe
+void* lenStripe(void* arg){
+    stripe_t* stripe = arg;
+    table_t* table = stripe->table;
+    for(int i = stripe->R1; i < stripe->R2; i++){
+        row_t* row = ROW(i);
+        //the empty cells past the end of the row add nothing
+        int C2 = stripe->C2 < row->len ? stripe->C2 : row->len;
+        for(int j = stripe->C1; j < C2; j++){
+            char tmp[NUM_TEXT_SIZE];
+            stripe->count += strlen(cellText(CELLP(row, j), tmp));
+        }
+    }
+    return NULL;
+}
+
+//stores the stripe's cell into all of its slots, stripes never share a word
+//of the numeric columns' bitmaps, so they can be updated too
+void* fillStripe(void* arg){
+    stripe_t* stripe = arg;
+    table_t* table = stripe->table;
+    for(int i = stripe->R1; i < stripe->R2; i++){
+        row_t* row = ROW(i);
+        int C2 = stripe->C2;
+        //empty cells past the end of the row stay unstored
+        if(stripe->cell == &emptyCell && C2 > row->len) C2 = row->len;
+        else if(storeCells(row, C2)){
+            //the rest of the stripe doesn't take the cell
+            stripe->count = (stripe->R2 - i) * (stripe->C2 - stripe->C1);
+            stripe->err = EXIT_FAILURE;
+            return NULL;
+        }
+        for(int j = stripe->C1; j < C2; j++){
+            unrefCell(CELLP(row, j));
+            CELLP(row, j) = stripe->cell;
+            noteWrite(table, i, j);
+        }
+    }
+    return NULL;
+}
+
+//saves a number from cell on [R,C] to out, returns EXIT_SUCCESS if the cell
+//contains only a number, EXIT_FAILURE if not
+int getNumInCell(table_t* table, int R, int C, double* out){
+    if(table->len <= R || table->width <= C) return EXIT_FAILURE;
+    return cellNum(CELL(R, C), out);
+}
+
+//returns the bucket of the trigram starting at text
+int trigramBucket(const char* text){
+    uint32_t tri = (unsigned char)text[0] << 16 | (unsigned char)text[1] << 8 | (unsigned char)text[2];
+    return (tri * 2654435761u) >> (32 - INDEX_BITS);
+}
+
+//adds cell [R,C] to the buckets of all trigrams in text, returns the number
+//of postings added or -1 on allocation failure
+long indexText(findIndex_t* index, int R, int C, const char* text){
+    long added = 0;
+    for(int i = 0; text[i] != 0 && text[i + 1] != 0 && text[i + 2] != 0; i++){
+        posting_t* bucket = &index->buckets[trigramBucket(text + i)];
+        //a trigram repeated in the cell is listed once
+        if(bucket->len > 0 && bucket->cells[bucket->len - 2] == R && bucket->cells[bucket->len - 1] == C){
+            continue;
+        }
+        if(bucket->len == bucket->allocLen){
+            int newAllocLen = bucket->allocLen == 0 ? 16 : bucket->allocLen * 2;
+            int* newCells = realloc(bucket->cells, newAllocLen * sizeof(int));
+            if(newCells == NULL) return -1;
+            bucket->cells = newCells;
+            bucket->allocLen = newAllocLen;
+        }
+        bucket->cells[bucket->len++] = R;
+        bucket->cells[bucket->len++] = C;
+        added++;
+    }
+    return added;
+}
+
+//builds the trigram index of all cells, leaves it NULL on allocation failure
+void buildFindIndex(table_t* table){
+    findIndex_t* index = calloc(1, sizeof(findIndex_t));
+    if(index == NULL) return;
+    table->findIndex = index;
+    for(int i = 0; i < table->len; i++){
+        for(int j = 0; j < ROW(i)->len; j++){
+            char tmp[NUM_TEXT_SIZE];
+            long added = indexText(index, i, j, cellText(CELL(i, j), tmp));
+            if(added < 0){
+                dropFindIndex(table);
+                return;
+            }
+            index->built += added;
+        }
+    }
+}
+
+//adds the new text of cell [R,C] to the trigram index, the index is dropped
+//once writes added more postings than it was built with
+void indexWrite(table_t* table, int R, int C){
+    findIndex_t* index = table->findIndex;
+    if(index == NULL) return;
+    char tmp[NUM_TEXT_SIZE];
+    long added = indexText(index, R, C, cellText(CELL(R, C), tmp));
+    if(added < 0 || (index->added += added) > index->built){
+        dropFindIndex(table);
+    }
+}
+
+//finds the first cell of sel containing str using the trigram index, str
+//has at least 3 characters, every cell containing it is listed in the
+//buckets of all of its trigrams, so only the smallest bucket is checked
+void indexFind(table_t* table, stripe_t* sel, const char* str){
+    posting_t* best = NULL;
+    for(int i = 0; str[i + 2] != 0; i++){
+        posting_t* bucket = &table->findIndex->buckets[trigramBucket(str + i)];
+        if(best == NULL || bucket->len < best->len) best = bucket;
+    }
+    for(int k = 0; k < best->len; k += 2){
+        int R = best->cells[k], C = best->cells[k + 1];
+        if(R < sel->R1 || R >= sel->R2 || C < sel->C1 || C >= sel->C2) continue;
+        //the bucket isn't ordered, keep the first cell in row-major order
+        if(sel->R >= 0 && (R > sel->R || (R == sel->R && C >= sel->C))) continue;
+        char tmp[NUM_TEXT_SIZE];
+        if(strstr(cellText(CELL(R, C), tmp), str) != NULL){
+            sel->R = R;
+            sel->C = C;
+        }
+    }
+}
+
+//adds row R with text to a collumn's hash index, returns EXIT_FAILURE on
+//allocation failure
+int lookupAdd(lookup_t* lookup, int R, const char* text){
+    if(lookup->len == lookup->allocLen){
+        int newAllocLen = lookup->allocLen == 0 ? 16 : lookup->allocLen * 2;
+        int* newNext = realloc(lookup->next, newAllocLen * sizeof(int));
+        if(newNext == NULL) return EXIT_FAILURE;
+        lookup->next = newNext;
+        int* newRows = realloc(lookup->rows, newAllocLen * sizeof(int));
+        if(newRows == NULL) return EXIT_FAILURE;
+        lookup->rows = newRows;
+        lookup->allocLen = newAllocLen;
+    }
+    int bucket = hashText(text) & lookup->mask;
+    lookup->rows[lookup->len] = R;
+    lookup->next[lookup->len] = lookup->heads[bucket];
+    lookup->heads[bucket] = lookup->len++;
+    return EXIT_SUCCESS;
+}
+
+//returns the hash index of collumn C, builds it if it doesn't exist yet,
+//returns NULL on allocation failure
+lookup_t* getLookup(table_t* table, int C){
+    if(C >= table->lookupsLen){
+        lookup_t** newLookups = realloc(table->lookups, (C + 1) * sizeof(lookup_t*));
+        if(newLookups == NULL) return NULL;
+        for(int i = table->lookupsLen; i <= C; i++) newLookups[i] = NULL;
+        table->lookups = newLookups;
+        table->lookupsLen = C + 1;
+    }
+    if(table->lookups[C] != NULL) return table->lookups[C];
+
+    lookup_t* lookup = calloc(1, sizeof(lookup_t));
+    if(lookup == NULL) return NULL;
+    //at least twice as many buckets as rows
+    int buckets = 16;
+    while(buckets < 2 * table->len) buckets *= 2;
+    lookup->mask = buckets - 1;
+    lookup->heads = malloc(buckets * sizeof(int));
+    if(lookup->heads == NULL){
+        freeLookup(lookup);
+        return NULL;
+    }
+    for(int i = 0; i < buckets; i++) lookup->heads[i] = -1;
+    for(int i = 0; i < table->len; i++){
+        char tmp[NUM_TEXT_SIZE];
+        if(lookupAdd(lookup, i, cellText(CELL(i, C), tmp))){
+            freeLookup(lookup);
+            return NULL;
+        }
+    }
+    lookup->built = lookup->len;
+    table->lookups[C] = lookup;
+    return lookup;
+}
+
+//adds the new text of cell [R,C] to its collumn's hash index, the index is
+//dropped once writes added more entries than it was built with
+void lookupWrite(table_t* table, int R, int C){
+    if(C >= table->lookupsLen || table->lookups[C] == NULL) return;
+    lookup_t* lookup = table->lookups[C];
+    char tmp[NUM_TEXT_SIZE];
+    if(lookupAdd(lookup, R, cellText(CELL(R, C), tmp)) || lookup->len - lookup->built > lookup->built){
+        freeLookup(lookup);
+        table->lookups[C] = NULL;
+    }
+}
+
+//keeps the indexes up to date after cell [R,C] was written, unlike noteWrite
+//it must not run on more threads at once
+void updateIndexes(table_t* table, int R, int C){
+    indexWrite(table, R, C);
+    lookupWrite(table, R, C);
+    if(C < table->columnsLen && table->columns[C] != NULL) treeWrite(table->columns[C], R);
+}
+
+//returns selection to the cell in collumn C of the first row equal to str,
+//returns selection to 0,0 if there is none
+selection_t lookup(table_t* table, int C, const char* str){
+    selection_t out = {0, 0, 0, 0};
+    C--;
+    if(C >= tableWidth(table)) return out;
+    lookup_t* lookup = getLookup(table, C);
+    if(lookup == NULL){
+        fprintf(stderr, "Memory allocation failure\n");
+        return out;
+    }
+    int first = -1;
+    for(int e = lookup->heads[hashText(str) & lookup->mask]; e >= 0; e = lookup->next[e]){
+        int R = lookup->rows[e];
+        //the bucket isn't ordered and holds old texts of rows too
+        if(first >= 0 && R >= first) continue;
+        char tmp[NUM_TEXT_SIZE];
+        if(!strcmp(cellText(CELL(R, C), tmp), str)) first = R;
+    }
+    if(first >= 0){
+        out.R1 = first + 1; out.R2 = first + 1;
+        out.C1 = C + 1; out.C2 = C + 1;
+    }
+    return out;
+}
+
+//returns selection to first cell in current selection that contains str,
+//returns selection to 0,0 if the string is not found in current selection
+selection_t find(table_t* table, const char* str){
+    selection_t out = {0, 0, 0, 0};
+    stripe_t sel = clipSelection(table, table->selection);
+    sel.str = str;
+    //repeated searches for strings long enough to have trigrams use the index
+    if(strlen(str) >= 3){
+        if(table->findIndex == NULL && ++table->finds >= INDEX_FINDS) buildFindIndex(table);
+        if(table->findIndex != NULL){
+            indexFind(table, &sel, str);
+            if(sel.R >= 0){
+                out.R1 = sel.R + 1; out.R2 = sel.R + 1;
+                out.C1 = sel.C + 1; out.C2 = sel.C + 1;
+            }
+            return out;
+        }
+    }
+    int count;
+    stripe_t* stripes = runStripes(table, sel, findStripe, &count);
+    if(stripes == NULL){
+        fprintf(stderr, "Memory allocation failure\n");
+        return out;
+    }
+    //the first stripe with a match holds the first match
+    for(int k = 0; k < count; k++){
+        if(stripes[k].R >= 0){
+            out.R1 = stripes[k].R + 1; out.R2 = stripes[k].R + 1;
+            out.C1 = stripes[k].C + 1; out.C2 = stripes[k].C + 1;
+            break;
+        }
+    }
+    free(stripes);
+    return out;
+}
+
+//returns selection to a cell with the min or max number, if no numbers are found,
+//returns selection to 0,0
+selection_t minMax(table_t* table, bool minOrMax){
+    double num = minOrMax ? __DBL_MAX__ : __DBL_MIN__;
+    selection_t selection = {0, 0, 0, 0};
+    stripe_t sel;
+    if(columnSelection(table, &sel)){
+        bool trees = true;
+        for(int j = sel.C1; trees && j < sel.C2; j++){
+            trees = getTree(table->columns[j], minOrMax) != NULL;
+        }
+        //a query per collumn, the first cell in row-major order wins ties
+        for(int j = sel.C1; trees && j < sel.C2; j++){
+            column_t* column = table->columns[j];
+            int R = treeBest(column, minOrMax ? column->minTree : column->maxTree, minOrMax, sel.R1, sel.R2);
+            if(R < 0) continue;
+            double best = column->num[R];
+            if((minOrMax ? best < num : best > num) ||
+                (selection.R1 != 0 && best == num && R + 1 < selection.R1)){
+                num = best;
+                selection.R1 = R + 1; selection.R2 = R + 1;
+                selection.C1 = j + 1; selection.C2 = j + 1;
+            }
+        }
+        if(trees) return selection;
+
+        //not enough memory for the trees, scan the collumns instead
+        sel.minOrMax = minOrMax;
+        sel.num = num;
+        int count;
+        stripe_t* stripes = runStripes(table, sel, bestStripe, &count);
+        if(stripes == NULL){
+            fprintf(stderr, "Memory allocation failure\n");
+            return selection;
+        }
+        //stripes are in row order, so a tie keeps the earlier one
+        for(int k = 0; k < count; k++){
+            if(stripes[k].R < 0) continue;
+            if(selection.R1 == 0 || (minOrMax ? stripes[k].num < num : stripes[k].num > num)){
+                num = stripes[k].num;
+                selection.R1 = stripes[k].R + 1; selection.R2 = stripes[k].R + 1;
+                selection.C1 = stripes[k].C + 1; selection.C2 = stripes[k].C + 1;
+            }
+        }
+        free(stripes);
+        return selection;
+    }
+    for(int i = table->selection.R1; i <= table->selection.R2; i++){
+        for(int j = table->selection.C1; j <= table->selection.C2; j++){
+            double tmp;
+            if(!getNumInCell(table, i - 1, j - 1, &tmp)){
+                if(minOrMax){
+                    if(tmp < num){
+                        num = tmp;
+                        selection.R1 = i; selection.R2 = i;
+                        selection.C1 = j; selection.C2 = j;
+                    } 
+                }
+                else{
+                    if(tmp > num){
+                        num = tmp;
+                        selection.R1 = i; selection.R2 = i;
+                        selection.C1 = j; selection.C2 = j;
+                    } 
+                }
+            }
+        }
+    }
+    return selection;
+}
+
+//stores cell into every slot of selection, the cell takes over the caller's
+//reference and is shared by all of the slots, so writing a cell costs one
+//pointer store, big selections are written in stripes in parallel
+int fillSelection(table_t* table, selection_t selection, cell_t* cell){
+    if(expandTable(table, selection.R2 - 1, selection.C2 - 1)){
+        unrefCell(cell);
+        fprintf(stderr, "Memory allocation failure\n");
+        return EXIT_FAILURE;
+    }
+    stripe_t sel = clipSelection(table, selection);
+    sel.cell = cell;
+    int cells = (sel.R2 - sel.R1) * (sel.C2 - sel.C1);
+    if(cells == 0){
+        unrefCell(cell);
+        return EXIT_SUCCESS;
+    }
+    if(cell != &emptyCell){
+        //a shared cell is parsed now, so stripes only ever read it
+        double num;
+        if(cells > 1) cellNum(cell, &num);
+        cell->refs += cells - 1;
+    }
+    //number of slots that didn't take the cell
+    int missed = 0;
+    if(cells == 1){
+        fillStripe(&sel);
+        missed = sel.count;
+    }
+    else{
+        int count;
+        stripe_t* stripes = runStripes(table, sel, fillStripe, &count);
+        if(stripes == NULL) missed = cells;
+        for(int k = 0; stripes != NULL && k < count; k++) missed += stripes[k].count;
+        free(stripes);
+    }
+    if(missed > 0){
+        if(cell != &emptyCell) cell->refs -= missed - 1;
+        unrefCell(cell);
+        fprintf(stderr, "Memory allocation failure\n");
+        return EXIT_FAILURE;
+    }
+    //trees of collumns written in big parts are rebuilt instead of updated
+    bool trees = false;
+    for(int j = sel.C1; j < sel.C2 && j < table->columnsLen; j++){
+        column_t* column = table->columns[j];
+        if(column == NULL) continue;
+        if(sel.R2 - sel.R1 > column->len / 8) dropTrees(column);
+        trees = trees || column->minTree != NULL || column->maxTree != NULL;
+    }
+    if(trees || table->findIndex != NULL || table->lookups != NULL){
+        for(int i = sel.R1; i < sel.R2; i++){
+            for(int j = sel.C1; j < sel.C2; j++) updateIndexes(table, i, j);
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+//sets the content of cells in selection to str
+int setStr(table_t* table, char* str, selection_t selection){
+    cell_t* cell = cell_from(str, strlen(str));
+    if(cell == NULL){
+        fprintf(stderr, "Memory allocation failure\n");
+        return EXIT_FAILURE;
+    }
+    return fillSelection(table, selection, cell);
+}
+
+//swaps all cells in table.selection with cell in selection
+int swap(table_t* table, selection_t selection){
+    cell_t* tmp;
+    //save temporary shorter variables for readability
+    int sR1 = selection.R1; int sC1 = selection.C1;
+    int tR1 = table->selection.R1; int tR2 = table->selection.R2;
+    int tC1 = table->selection.C1; int tC2 = table->selection.C2;
+
+    //if selection isn't in table, expand it
+    if(expandTable(table, sR1 > tR2 ? sR1 : tR2, sC1 > tC2 ? sC1 : tC2)){
+        fprintf(stderr, "Memory allocation failure\n");
+        return EXIT_FAILURE;
+    }
+
+    if(storeCells(ROW(sR1 - 1), sC1)){
+        fprintf(stderr, "Memory allocation failure\n");
+        return EXIT_FAILURE;
+    }
+    for(int i = tR1 - 1; i < tR2; i++){
+        if(storeCells(ROW(i), tC2)){
+            fprintf(stderr, "Memory allocation failure\n");
+            return EXIT_FAILURE;
+        }
+        for(int j = tC1 - 1; j < tC2; j++){
+            tmp = CELLP(ROW(i), j);
+            CELLP(ROW(i), j) = CELLP(ROW(sR1 - 1), sC1 - 1);
+            CELLP(ROW(sR1 - 1), sC1 - 1) = tmp;
+            noteWrite(table, i, j);
+            noteWrite(table, sR1 - 1, sC1 - 1);
+            updateIndexes(table, i, j);
+            updateIndexes(table, sR1 - 1, sC1 - 1);
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+//saves a number as a string into cell in selection, a single cell keeps the
+//number and gets its text when the table is printed
+int printNumToCell(table_t* table, selection_t selection, double num){
+    //a query of the server returns the number instead
+    if(table->reply != NULL){
+        char outStr[NUM_TEXT_SIZE + 1];
+        int len = snprintf(outStr, sizeof(outStr), "%g\n", num);
+        return putBytes(table->reply, outStr, len);
+    }
+    if(selection.R1 == selection.R2 && selection.C1 == selection.C2){
+        cell_t* cell = malloc(sizeof(cell_t));
+        if(cell == NULL){
+            fprintf(stderr, "Memory allocation failure\n");
+            return EXIT_FAILURE;
+        }
+        cell->content = NULL;
+        cell->len = 0;
+        cell->refs = 1;
+        cell->num = num;
+        cell->numState = NUM_EXACT;
+        cell->plain = false;
+        return fillSelection(table, selection, cell);
+    }
+
+    //print the number once, all cells share it
+    char outStr[NUM_TEXT_SIZE];
+    snprintf(outStr, NUM_TEXT_SIZE, "%g", num);
+    return setStr(table, outStr, selection);
+}
+
+//gets the sum or average of numbers in table.selection and saves it in the
+//cell from selection. Big selections are summed over numeric collumns in
+//another order with compensation, so they can differ from the cell by cell
+//sum, slightly or, when big numbers cancel out, in every digit.
+int sumAvg(table_t* table, selection_t selection, bool isAvg){
+    double sum = 0;
+    int count = 0;
+    stripe_t sel;
+    if(columnSelection(table, &sel)){
+        int stripeCount;
+        stripe_t* stripes = runStripes(table, sel, sumStripe, &stripeCount);
+        if(stripes == NULL){
+            fprintf(stderr, "Memory allocation failure\n");
+            return EXIT_FAILURE;
+        }
+        double comp = 0;
+        for(int k = 0; k < stripeCount; k++){
+            comp += stripes[k].comp;
+            addComp(&sum, &comp, stripes[k].num);
+            count += stripes[k].count;
+        }
+        free(stripes);
+        sum = compSum(sum, comp);
+    }
+    else for(int i = table->selection.R1 - 1; i < table->selection.R2; i++){
+        for(int j = table->selection.C1 - 1; j < table->selection.C2; j++){
+            double num;
+            if(!getNumInCell(table, i, j, &num)){
                 sum += num;
                 count++;
             }
         }
     }
-    if(isAvg) sum /= count;
-    if(printNumToCell(table, selection, sum)){
-        fprintf(stderr, "Memory allocation failure\n");
+    if(isAvg) sum /= count;
+    if(printNumToCell(table, selection, sum)){
+        fprintf(stderr, "Memory allocation failure\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+//counts the number of non empty cells in table.selection, saves it in cell
+//in selection
+int count(table_t* table, selection_t selection){
+    int count = 0;
+    stripe_t sel;
+    if(columnSelection(table, &sel)){
+        int stripeCount;
+        stripe_t* stripes = runStripes(table, sel, countStripe, &stripeCount);
+        if(stripes == NULL){
+            fprintf(stderr, "Memory allocation failure\n");
+            return EXIT_FAILURE;
+        }
+        for(int k = 0; k < stripeCount; k++) count += stripes[k].count;
+        free(stripes);
+    }
+    else for(int i = table->selection.R1 - 1; i < table->selection.R2; i++){
+        if(i >= table->len) break;
+        for(int j = table->selection.C1 - 1; j < table->selection.C2; j++){
+            if(j >= ROW(i)->len) break;
+            if(!cellEmpty(CELL(i, j))) count++;
+        }
+    }
+
+    if(printNumToCell(table, selection, count)){
+        fprintf(stderr, "Memory allocation failure\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+//gets the length of all text in all cels in table.selection, saves it into
+//cell in selection
+int len(table_t* table, selection_t selection){
+    int len = 0;
+    int count;
+    stripe_t* stripes = runStripes(table, clipSelection(table, table->selection), lenStripe, &count);
+    if(stripes == NULL){
+        fprintf(stderr, "Memory allocation failure\n");
+        return EXIT_FAILURE;
+    }
+    for(int k = 0; k < count; k++) len += stripes[k].count;
+    free(stripes);
+
+    if(printNumToCell(table, selection, len)){
+        fprintf(stderr, "Memory allocation failure\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+//saves the text or number in the first cell of table.selection in a temporary 
+//variable var
+int def(table_t* table, int var){
+    double num;
+    if(!getNumInCell(table, table->selection.R1 - 1, table->selection.C1 - 1, &num)){
+        table->vars[var]->num = num;
+        table->vars[var]->isNum = true;
+    }
+    else{
+        char tmp[NUM_TEXT_SIZE];
+        const char* text = cellText(CELL(table->selection.R1 - 1, table->selection.C1 - 1), tmp);
+        char* newText = realloc(table->vars[var]->text, strlen(text) + 1 * sizeof(char));
+        if(newText == NULL){
+            fprintf(stderr, "Memory allocation failure\n");
+            return EXIT_FAILURE;
+        }
+        strcpy(newText, text);
+        table->vars[var]->text = newText;
+        table->vars[var]->isNum = false;
+    }
+    return EXIT_SUCCESS;
+}
+
+//puts content of temporary variable var into all cells in table.selection
+int use(table_t* table, int var){
+    if(table->vars[var]->isNum){
+        return printNumToCell(table, table->selection, table->vars[var]->num);
+    }
+    return setStr(table, table->vars[var]->text, table->selection);
+}
+
+//increments the temporary variable var, if it isn't a number, set it to 1
+void inc(table_t* table, int var){
+    if(table->vars[var]->isNum) table->vars[var]->num++;
+    else{
+        table->vars[var]->isNum = true;
+        table->vars[var]->num = 1;
+    }
+}
+
+//free the compiled program
+void freeProgram(program_t* prog){
+    for(int i = 0; i < prog->strsLen; i++){
+        if(prog->cells[i] != NULL) unrefCell(prog->cells[i]);
+    }
+    free(prog->code);
+    free(prog->sels);
+    free(prog->strs);
+    free(prog->cells);
+}
+
+//returns the command index a goto or iszero at command k jumps to
+int jumpTarget(command_t* cmds, int k){
+    return k + (cmds[k].name == GOTO ? cmds[k].var : cmds[k].var2) + 1;
+}
+
+//returns the op of the instruction fusing commands k and k + 1, or UNKNOWN
+//if they can't be fused, nothing may jump between them
+int fusedOp(command_t* cmds, int cmdCount, bool* isTarget, int k){
+    if(k + 1 >= cmdCount || isTarget[k + 1]) return UNKNOWN;
+    command_t* next = &cmds[k + 1];
+    if(cmds[k].name == SELECTION){
+        if(next->name == SET_STR) return SEL_SET;
+        if(next->name == CLEAR) return SEL_CLEAR;
+        if(next->name == USE_TEMP) return SEL_USE;
+        if(next->name == DEF_TEMP) return SEL_DEF;
+    }
+    //the usual loop counter, iszero testing the variable sub just changed
+    if(cmds[k].name == SUB && next->name == ISZERO && next->var == cmds[k].var) return SUB_ISZERO;
+    return UNKNOWN;
+}
+
+//saves str for the program, set also gets its cell ready, returns the index
+//of the string or -1 on allocation failure
+int addString(program_t* prog, const char* str, bool isSet){
+    int i = prog->strsLen;
+    prog->strs[i] = str;
+    prog->cells[i] = NULL;
+    if(isSet){
+        //parsed now, so all the slots it's stored into only ever read it
+        double num;
+        if((prog->cells[i] = cell_from(str, strlen(str))) == NULL){
+            fprintf(stderr, "Memory allocation failure\n");
+            return -1;
+        }
+        cellNum(prog->cells[i], &num);
+    }
+    prog->strsLen++;
+    return i;
+}
+
+//compiles the commands into prog, jumps are resolved to instructions and
+//common pairs of commands are fused, returns EXIT_FAILURE on allocation failure
+int compileCommands(command_t* cmds, int cmdCount, program_t* prog){
+    prog->code = malloc((cmdCount + 2) * sizeof(instr_t));
+    prog->sels = malloc((cmdCount + 1) * sizeof(selection_t));
+    prog->strs = malloc((cmdCount + 1) * sizeof(char*));
+    prog->cells = malloc((cmdCount + 1) * sizeof(cell_t*));
+    //instruction of every command and of the end
+    int* at = malloc((cmdCount + 1) * sizeof(int));
+    bool* isTarget = calloc(cmdCount + 1, sizeof(bool));
+    //innermost foreach around every command, -1 if there is none, and the
+    //matching end of every foreach
+    int* loopOf = malloc((cmdCount + 1) * sizeof(int));
+    int* match = malloc((cmdCount + 1) * sizeof(int));
+    prog->len = 0;
+    prog->selsLen = 0;
+    prog->strsLen = 0;
+    if(prog->code == NULL || prog->sels == NULL || prog->strs == NULL || prog->cells == NULL ||
+        at == NULL || isTarget == NULL || loopOf == NULL || match == NULL){
+        free(at);
+        free(isTarget);
+        free(loopOf);
+        free(match);
+        freeProgram(prog);
+        fprintf(stderr, "Memory allocation failure\n");
+        return EXIT_FAILURE;
+    }
+
+    //pair foreach commands with their ends
+    int err = EXIT_SUCCESS;
+    int loops[MAX_LOOPS], depth = 0;
+    for(int k = 0; k < cmdCount && !err; k++){
+        loopOf[k] = depth > 0 ? loops[depth - 1] : -1;
+        if(cmds[k].name == FOREACH_ROWS || cmds[k].name == FOREACH_CELLS){
+            if(depth == MAX_LOOPS){
+                fprintf(stderr, "Foreach nested too deep\n");
+                err = EXIT_FAILURE;
+            }
+            else loops[depth++] = k;
+        }
+        else if(cmds[k].name == END_EACH){
+            if(depth == 0){
+                fprintf(stderr, "End without foreach\n");
+                err = EXIT_FAILURE;
+            }
+            else match[loops[--depth]] = k;
+        }
+    }
+    if(!err && depth > 0){
+        fprintf(stderr, "Foreach without end\n");
+        err = EXIT_FAILURE;
+    }
+
+    for(int k = 0; k < cmdCount && !err; k++){
+        if(cmds[k].name != GOTO && cmds[k].name != ISZERO) continue;
+        int target = jumpTarget(cmds, k);
+        if(target >= 0 && target < cmdCount) isTarget[target] = true;
+        //a foreach body can only be entered and left through foreach and end
+        if((target >= 0 && target < cmdCount ? loopOf[target] : -1) != loopOf[k]){
+            fprintf(stderr, "Jump into or out of a foreach body\n");
+            err = EXIT_FAILURE;
+        }
+    }
+
+    for(int k = 0; k < cmdCount && !err; k++){
+        command_t* cmd = &cmds[k];
+        instr_t instr = {cmd->name, 0, 0, 0, 0};
+        at[k] = prog->len;
+        int op = fusedOp(cmds, cmdCount, isTarget, k);
+        switch(op == UNKNOWN ? cmd->name : op){
+            case SELECTION: case SWAP: case SUM: case AVG: case COUNT: case LEN:
+                prog->sels[prog->selsLen] = cmd->selection;
+                instr.arg = prog->selsLen++;
+                break;
+            case SELECTION_FIND: case SET_STR:
+                instr.arg = addString(prog, cmd->str, cmd->name == SET_STR);
+                err = instr.arg < 0;
+                break;
+            case SELECTION_LOOKUP:
+                instr.arg = addString(prog, cmd->str, false);
+                instr.arg2 = cmd->var;
+                err = instr.arg < 0;
+                break;
+            case FILTER:
+                instr.arg = addString(prog, cmd->str, false);
+                instr.arg2 = cmd->var;
+                instr.var = cmd->var2;
+                err = instr.arg < 0;
+                break;
+            case IROW: case AROW: case ICOL: case ACOL:
+                instr.arg = cmd->var;
+                break;
+            case DEF_TEMP: case USE_TEMP: case INC_TEMP: case SUB:
+                instr.var = cmd->var;
+                instr.var2 = cmd->var2;
+                break;
+            case ISZERO:
+                instr.var = cmd->var;
+                break;
+            case SEL_SET: case SEL_CLEAR: case SEL_USE: case SEL_DEF:
+                prog->sels[prog->selsLen] = cmd->selection;
+                instr.arg = prog->selsLen++;
+                instr.var = cmds[k + 1].var;
+                if(op == SEL_SET){
+                    instr.arg2 = addString(prog, cmds[k + 1].str, true);
+                    err = instr.arg2 < 0;
+                }
+                break;
+            case SUB_ISZERO:
+                instr.var = cmd->var;
+                instr.var2 = cmd->var2;
+                break;
+        }
+        if(op != UNKNOWN){
+            instr.op = op;
+            at[++k] = prog->len;
+        }
+        prog->code[prog->len++] = instr;
+    }
+    at[cmdCount] = prog->len;
+    instr_t end = {END, 0, 0, 0, 0};
+    instr_t fail = {FAIL, 0, 0, 0, 0};
+    prog->code[prog->len++] = end;
+    prog->code[prog->len++] = fail;
+
+    //resolve the jumps, jumping before the first command is an error and
+    //jumping past the last one ends the program
+    for(int k = 0; k < cmdCount && !err; k++){
+        if(cmds[k].name == FOREACH_ROWS || cmds[k].name == FOREACH_CELLS){
+            //an empty selection skips the body, end goes back to its start
+            prog->code[at[k]].arg = at[match[k] + 1];
+            prog->code[at[match[k]]].arg = at[k + 1];
+        }
+        if(cmds[k].name != GOTO && cmds[k].name != ISZERO) continue;
+        int target = jumpTarget(cmds, k);
+        int pc = target < 0 ? prog->len - 1 : at[target > cmdCount ? cmdCount : target];
+        //an iszero fused with the sub before it shares its instruction
+        prog->code[at[k]].arg = pc;
+    }
+    free(at);
+    free(isTarget);
+    free(loopOf);
+    free(match);
+    if(err){
+        freeProgram(prog);
         return EXIT_FAILURE;
     }
     return EXIT_SUCCESS;
 }
 
-//counts the number of non empty cells in table.selection, saves it in cell
-//in selection
-int count(table_t* table, selection_t selection){
-    int count = 0;
-    for(int i = table->selection.R1 - 1; i < table->selection.R2; i++){
-        if(i >= table->len) break;
-        for(int j = table->selection.C1 - 1; j < table->selection.C2; j++){
-            if(j >= table->rows[i]->len) break;
-            if(strcmp(CELL(i, j), "")) count++;
+//starts a foreach over the rows (or cells) of the selection clipped to the
+//table and selects the first one, returns false if there are none
+bool startLoop(table_t* table, loop_t* loop, bool cells){
+    selection_t sel = table->selection;
+    int width = tableWidth(table);
+    loop->selection = sel;
+    loop->cells = cells;
+    loop->R = sel.R1;
+    loop->C = sel.C1;
+    loop->C1 = sel.C1;
+    loop->R2 = sel.R2 > table->len ? table->len : sel.R2;
+    loop->C2 = cells && sel.C2 > width ? width : sel.C2;
+    if(loop->R > loop->R2 || loop->C > loop->C2) return false;
+    selection_t first = {loop->R, loop->C, loop->R, cells ? loop->C : loop->C2};
+    table->selection = first;
+    return true;
+}
+
+//moves a foreach to its next row (or cell) and selects it, returns false
+//when it is done
+bool nextLoop(table_t* table, loop_t* loop){
+    if(!loop->cells || ++loop->C > loop->C2){
+        loop->C = loop->C1;
+        if(++loop->R > loop->R2) return false;
+    }
+    selection_t next = {loop->R, loop->C, loop->R, loop->cells ? loop->C : loop->C2};
+    table->selection = next;
+    return true;
+}
+
+//returns position p (from 1) after count positions were inserted (count > 0)
+//or deleted (count < 0) after position at, the first position of a range
+//stays on the first one left, the current one stays before the positions
+//inserted right after it, so a loop never visits them
+int movePos(int p, int at, int count, bool current, bool first){
+    if(count > 0) return p > at || (current && p == at) ? p + count : p;
+    if(p <= at) return p;
+    int gone = p - at - (first ? 1 : 0);
+    return p - (gone < -count ? gone : -count);
+}
+
+//moves the rows (or collumns) of the running foreach loops after count of
+//them were inserted or deleted after row (or collumn) at
+int shiftLoops(loop_t* loops, int depth, bool rows, int at, int count){
+    for(int k = 0; k < depth && count != 0; k++){
+        loop_t* loop = &loops[k];
+        if(rows){
+            loop->R = movePos(loop->R, at, count, true, false);
+            loop->R2 = movePos(loop->R2, at, count, false, false);
+        }
+        else{
+            loop->C = movePos(loop->C, at, count, true, false);
+            loop->C1 = movePos(loop->C1, at, count, false, true);
+            loop->C2 = movePos(loop->C2, at, count, false, false);
         }
     }
+    return EXIT_SUCCESS;
+}
 
-    if(printNumToCell(table, selection, count)){
-        fprintf(stderr, "Memory allocation failure\n");
-        return EXIT_FAILURE;
+//deletes the rows of the selection like filterRows inside foreach loops, one
+//row at a time from the last one, so the loops move over every deleted row
+int filterInLoops(table_t* table, loop_t* loops, int depth, int C, int op, const char* str){
+    int R2 = table->selection.R2 > table->len ? table->len : table->selection.R2;
+    for(int R = R2; R >= table->selection.R1; R--){
+        int len = table->len;
+        if(filterRows(table, R, R, C, op, str)) return EXIT_FAILURE;
+        shiftLoops(loops, depth, true, R - 1, table->len - len);
     }
     return EXIT_SUCCESS;
 }
 
-//gets the length of all text in all cels in table.selection, saves it into
-//cell in selection
-int len(table_t* table, selection_t selection){
-    int len = 0;
+//sets the selection to select if it was found
+void selectFound(table_t* table, selection_t select){
+    if(select.C1 != 0) table->selection = select;
+}
+
+//runs the compiled program, every instruction jumps straight to the code of
+//the next one with computed goto where the compiler supports it
+int runProgram(table_t* table, program_t* prog){
+    instr_t* code = prog->code;
+    tempVar_t** vars = table->vars;
+    int pc = 0;
+    loop_t loops[MAX_LOOPS];
+    int depth = 0;
+    //rows or collumns of the table before a command changing them
+    int size;
 
-    for(int i = table->selection.R1 - 1; i < table->selection.R2; i++){
-        for(int j = table->selection.C1 - 1; j < table->selection.C2; j++){  
-            if(i < table->len && j < table->rows[i]->len)
-                len += strlen(CELL(i, j));
+#ifdef __GNUC__
+    static void* labels[OP_COUNT] = {
+        [SELECTION] = &&L_SELECTION, [SELECTION_MAX] = &&L_SELECTION_MAX,
+        [SELECTION_MIN] = &&L_SELECTION_MIN, [SELECTION_FIND] = &&L_SELECTION_FIND,
+        [SELECTION_RESTORE] = &&L_SELECTION_RESTORE, [IROW] = &&L_IROW, [AROW] = &&L_AROW,
+        [DROW] = &&L_DROW, [ICOL] = &&L_ICOL, [ACOL] = &&L_ACOL, [DCOL] = &&L_DCOL,
+        [SET_STR] = &&L_SET_STR, [CLEAR] = &&L_CLEAR, [SWAP] = &&L_SWAP, [SUM] = &&L_SUM,
+        [AVG] = &&L_AVG, [COUNT] = &&L_COUNT, [LEN] = &&L_LEN, [DEF_TEMP] = &&L_DEF_TEMP,
+        [USE_TEMP] = &&L_USE_TEMP, [INC_TEMP] = &&L_INC_TEMP, [SET_TEMP] = &&L_SET_TEMP,
+        [GOTO] = &&L_GOTO, [ISZERO] = &&L_ISZERO, [SUB] = &&L_SUB,
+        [SELECTION_LOOKUP] = &&L_SELECTION_LOOKUP, [SEL_SET] = &&L_SEL_SET,
+        [SEL_CLEAR] = &&L_SEL_CLEAR, [SEL_USE] = &&L_SEL_USE, [SEL_DEF] = &&L_SEL_DEF,
+        [SUB_ISZERO] = &&L_SUB_ISZERO, [FOREACH_ROWS] = &&L_FOREACH_ROWS,
+        [FOREACH_CELLS] = &&L_FOREACH_CELLS, [END_EACH] = &&L_END_EACH, [FILTER] = &&L_FILTER,
+        [END] = &&L_END, [FAIL] = &&L_FAIL, [UNKNOWN] = &&L_FAIL
+    };
+    #define OP(name) L_##name:
+    #define NEXT() goto *labels[code[pc].op]
+    NEXT();
+#else
+    #define OP(name) case name:
+    #define NEXT() continue
+    for(;;) switch(code[pc].op){
+    default: goto fail;
+#endif
+    //commands changing the table balance it, so there are no missing collumns
+    #define CHECK(cmd) if(cmd) goto fail; if(balanceTable(table)) goto noMemory; pc++; NEXT()
+
+    OP(SELECTION) table->selection = prog->sels[code[pc].arg]; pc++; NEXT();
+    OP(SELECTION_FIND) selectFound(table, find(table, prog->strs[code[pc].arg])); pc++; NEXT();
+    OP(SELECTION_LOOKUP)
+        selectFound(table, lookup(table, code[pc].arg2, prog->strs[code[pc].arg]));
+        pc++; NEXT();
+    OP(SELECTION_MAX) selectFound(table, minMax(table, false)); pc++; NEXT();
+    OP(SELECTION_MIN) selectFound(table, minMax(table, true)); pc++; NEXT();
+    OP(SET_TEMP) table->tmpSelection = table->selection; pc++; NEXT();
+    OP(SELECTION_RESTORE) table->selection = table->tmpSelection; pc++; NEXT();
+    //commands inserting or deleting rows and collumns move the running loops
+    OP(IROW)
+        CHECK(insert_row(table, table->selection.R1 - 1, code[pc].arg) ||
+            shiftLoops(loops, depth, true, table->selection.R1 - 1, code[pc].arg));
+    OP(AROW)
+        CHECK(insert_row(table, table->selection.R2, code[pc].arg) ||
+            shiftLoops(loops, depth, true, table->selection.R2, code[pc].arg));
+    OP(DROW)
+        size = table->len;
+        CHECK(drow(table, table->selection.R1, table->selection.R2) ||
+            shiftLoops(loops, depth, true, table->selection.R1 - 1, table->len - size));
+    OP(DCOL)
+        size = tableWidth(table);
+        CHECK(dcol(table, table->selection.C1, table->selection.C2) ||
+            shiftLoops(loops, depth, false, table->selection.C1 - 1, tableWidth(table) - size));
+    OP(ICOL)
+        CHECK(insert_col(table, table->selection.C1 - 1, code[pc].arg) ||
+            shiftLoops(loops, depth, false, table->selection.C1 - 1, code[pc].arg));
+    OP(ACOL)
+        CHECK(insert_col(table, table->selection.C2, code[pc].arg) ||
+            shiftLoops(loops, depth, false, table->selection.C2, code[pc].arg));
+    OP(SET_STR)
+        refCell(prog->cells[code[pc].arg]);
+        CHECK(fillSelection(table, table->selection, prog->cells[code[pc].arg]));
+    OP(CLEAR) CHECK(fillSelection(table, table->selection, &emptyCell));
+    OP(SWAP) CHECK(swap(table, prog->sels[code[pc].arg]));
+    OP(SUM) CHECK(sumAvg(table, prog->sels[code[pc].arg], false));
+    OP(AVG) CHECK(sumAvg(table, prog->sels[code[pc].arg], true));
+    OP(COUNT) CHECK(count(table, prog->sels[code[pc].arg]));
+    OP(LEN) CHECK(len(table, prog->sels[code[pc].arg]));
+    OP(DEF_TEMP) CHECK(def(table, code[pc].var));
+    OP(USE_TEMP) CHECK(use(table, code[pc].var));
+    OP(INC_TEMP) inc(table, code[pc].var); pc++; NEXT();
+    OP(GOTO) pc = code[pc].arg; NEXT();
+    OP(ISZERO) pc = vars[code[pc].var]->num == 0 ? code[pc].arg : pc + 1; NEXT();
+    OP(SUB)
+        vars[code[pc].var]->isNum = true;
+        vars[code[pc].var2]->isNum = true;
+        vars[code[pc].var]->num -= vars[code[pc].var2]->num;
+        pc++; NEXT();
+    OP(SEL_SET)
+        table->selection = prog->sels[code[pc].arg];
+        refCell(prog->cells[code[pc].arg2]);
+        CHECK(fillSelection(table, table->selection, prog->cells[code[pc].arg2]));
+    OP(SEL_CLEAR)
+        table->selection = prog->sels[code[pc].arg];
+        CHECK(fillSelection(table, table->selection, &emptyCell));
+    OP(SEL_USE)
+        table->selection = prog->sels[code[pc].arg];
+        CHECK(use(table, code[pc].var));
+    OP(SEL_DEF)
+        table->selection = prog->sels[code[pc].arg];
+        CHECK(def(table, code[pc].var));
+    OP(SUB_ISZERO)
+        vars[code[pc].var]->isNum = true;
+        vars[code[pc].var2]->isNum = true;
+        vars[code[pc].var]->num -= vars[code[pc].var2]->num;
+        pc = vars[code[pc].var]->num == 0 ? code[pc].arg : pc + 1;
+        NEXT();
+    OP(FOREACH_ROWS)
+    OP(FOREACH_CELLS)
+        //nesting was checked by the compiler, so there is always a free loop
+        if(startLoop(table, &loops[depth], code[pc].op == FOREACH_CELLS)){
+            depth++;
+            pc++;
+        }
+        else pc = code[pc].arg;
+        NEXT();
+    OP(END_EACH)
+        if(nextLoop(table, &loops[depth - 1])) pc = code[pc].arg;
+        else{
+            table->selection = loops[--depth].selection;
+            pc++;
+        }
+        NEXT();
+    OP(FILTER)
+        if(depth > 0){
+            CHECK(filterInLoops(table, loops, depth, code[pc].arg2, code[pc].var, prog->strs[code[pc].arg]));
         }
+        CHECK(filterRows(table, table->selection.R1, table->selection.R2,
+            code[pc].arg2, code[pc].var, prog->strs[code[pc].arg]));
+    OP(FAIL) goto fail;
+    OP(END) return EXIT_SUCCESS;
+#ifndef __GNUC__
     }
+#endif
+    #undef OP
+    #undef NEXT
+    #undef CHECK
 
-    if(printNumToCell(table, selection, len)){
-        fprintf(stderr, "Memory allocation failure\n");
-        return EXIT_FAILURE;
+noMemory:
+    fprintf(stderr, "Memory allocation failure\n");
+fail:
+    return EXIT_FAILURE;
+}
+
+//checks if tmpPath is the file openReplacement created next to realPath
+bool nextToFile(const char* tmpPath, const char* realPath){
+    size_t len = strlen(realPath);
+    return strlen(tmpPath) == len + strlen(".XXXXXX") && !strncmp(tmpPath, realPath, len) && tmpPath[len] == '.';
+}
+
+//opens a new file the contents of fileName are written to before they
+//replace it, it is saved to tmpPath. The new file is made next to the file
+//fileName links to, with the same permissions and owner. When the file has
+//more links, its directory isn't writable or the owner can't be kept, the new
+//file is made in TMPDIR and copied into the old one by replaceFile instead.
+FILE* openReplacement(const char* fileName, char** tmpPath){
+    struct stat st;
+    char* realPath = realpath(fileName, NULL);
+    if(realPath == NULL || stat(realPath, &st)){
+        free(realPath);
+        *tmpPath = NULL;
+        return NULL;
     }
-    return EXIT_SUCCESS;
+    char* dirEnd = strrchr(realPath, '/');
+    *dirEnd = 0;
+    bool replace = st.st_nlink == 1 && !access(dirEnd == realPath ? "/" : realPath, W_OK);
+    *dirEnd = '/';
+
+    int fd = -1;
+    *tmpPath = malloc(strlen(realPath) + PATH_SIZE);
+    if(*tmpPath != NULL && replace){
+        sprintf(*tmpPath, "%s.XXXXXX", realPath);
+        fd = mkstemp(*tmpPath);
+        if(fd >= 0 && (fchmod(fd, st.st_mode & 07777) || fchown(fd, st.st_uid, st.st_gid))){
+            close(fd);
+            unlink(*tmpPath);
+            fd = -1;
+        }
+    }
+    if(*tmpPath != NULL && fd < 0){
+        char* dir = getenv("TMPDIR");
+        snprintf(*tmpPath, PATH_SIZE, "%s/sps-save-XXXXXX", dir != NULL && dir[0] ? dir : "/tmp");
+        fd = mkstemp(*tmpPath);
+    }
+    free(realPath);
+    FILE* file = NULL;
+    if(fd >= 0 && (file = fdopen(fd, "w")) == NULL){
+        close(fd);
+        unlink(*tmpPath);
+    }
+    if(file == NULL){
+        free(*tmpPath);
+        *tmpPath = NULL;
+    }
+    return file;
 }
 
-//saves the text or number in the first cell of table.selection in a temporary 
-//variable var
-int def(table_t* table, int var){
-    double num;
-    if(!getNumInCell(table, table->selection.R1 - 1, table->selection.C1 - 1, &num)){
-        table->vars[var]->num = num;
-        table->vars[var]->isNum = true;
+//checks if saving tmpPath with replaceFile writes into the old file itself
+bool savedInPlace(const char* tmpPath, const char* fileName){
+    char* realPath = realpath(fileName, NULL);
+    bool inPlace = realPath == NULL || !nextToFile(tmpPath, realPath);
+    free(realPath);
+    return inPlace;
+}
+
+//moves the written file tmpPath from openReplacement over the file fileName
+//links to, or copies it into that file. Copying isn't atomic, a copy that
+//stops partway leaves the old file damaged, so then tmpPath is kept with the
+//whole table and reported, otherwise it is deleted either way.
+int replaceFile(const char* tmpPath, const char* fileName){
+    char* realPath = realpath(fileName, NULL);
+    int err = realPath == NULL;
+    if(!err && nextToFile(tmpPath, realPath)){
+        err = rename(tmpPath, realPath) != 0;
+        free(realPath);
+        if(err) unlink(tmpPath);
+        return err ? EXIT_FAILURE : EXIT_SUCCESS;
     }
-    else{
-       char* newText = realloc(table->vars[var]->text, 
-            strlen(CELL(table->selection.R1 - 1, table->selection.C1 - 1)) + 1 * sizeof(char));
-        if(newText == NULL){
-            fprintf(stderr, "Memory allocation failure\n");
+    free(realPath);
+
+    //the old file keeps its inode, so its links and owner stay, it is only
+    //cut to the new size once all of it is written
+    size_t size = 0;
+    int from = open(tmpPath, O_RDONLY);
+    int to = err ? -1 : open(fileName, O_WRONLY);
+    char* buf = malloc(OUT_BUF_SIZE);
+    err = from < 0 || to < 0 || buf == NULL;
+    bool started = false;
+    while(!err){
+        ssize_t rslt = pread(from, buf, OUT_BUF_SIZE, size);
+        if(rslt < 0 && errno == EINTR) continue;
+        if(rslt <= 0){
+            err = rslt < 0;
+            break;
+        }
+        started = true;
+        err = writeAll(to, buf, rslt);
+        size += rslt;
+    }
+    if(!err) err = ftruncate(to, size) || fsync(to);
+    free(buf);
+    if(from >= 0) close(from);
+    if(to >= 0 && close(to)) err = true;
+    if(err && started) fprintf(stderr, "File only partly written, the table is in %s\n", tmpPath);
+    else unlink(tmpPath);
+    return err ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+//copies the lines of text to out and adds delims to the ones with less than
+//width cells
+int padLines(table_t* table, const char* text, size_t size, int width, outBuf_t* out){
+    const char* end = text + size;
+    for(const char* p = text; p < end;){
+        const char* lineEnd = memchr(p, '\n', end - p);
+        if(lineEnd == NULL) lineEnd = end;
+        lineInfo_t info;
+        if(measureLine(p, lineEnd, table->charClass, 0, &info) == NULL ||
+            putBytes(out, p, lineEnd - p)){
             return EXIT_FAILURE;
         }
-        strcpy(newText, CELL(table->selection.R1 - 1, table->selection.C1 - 1));
-        table->vars[var]->text = newText;
-        table->vars[var]->isNum = false;
+        for(int j = info.cells; j < width; j++){
+            if(putBytes(out, table->delim, 1)) return EXIT_FAILURE;
+        }
+        if(putBytes(out, "\n", 1)) return EXIT_FAILURE;
+        p = lineEnd + 1;
     }
     return EXIT_SUCCESS;
 }
 
-//puts content of temporary variable var into all cells in table.selection
-int use(table_t* table, int var){
-    for(int i = table->selection.R1 - 1; i < table->selection.R2; i++){
-        for(int j = table->selection.C1 - 1; j < table->selection.C2; j++){
-            int err;
-            if(table->vars[var]->isNum){
-                err = printNumToCell(table, table->selection, table->vars[var]->num);
-            }
-            else{
-                err = setStr(table, table->vars[var]->text, table->selection);
-            }
-            if(err){
+//Edits the table in fileName one row at a time without keeping it in memory,
+//the commands have to be rowLocal. Every row is written up to its last non
+//empty cell, if they don't all end in the same collumn, the short ones get
+//the missing delims in a second pass over the written file.
+int streamFile(table_t* table, const char* fileName, command_t* cmds, int cmdCount){
+    size_t size;
+    char* data = mapFile(fileName, &size);
+    if(data == NULL) return EXIT_FAILURE;
+    //tails of rows point into the input
+    table->source = data;
+    table->sourceLen = size;
+    const char* end = data + size;
+
+    //selections of all collumns need the width of the widest row
+    int width = 0;
+    for(int k = 0; k < cmdCount; k++){
+        if(!(cmds[k].ends & SEL_LAST_COL)) continue;
+        for(const char* p = data; p < end; p++){
+            lineInfo_t info;
+            if((p = measureLine(p, end, table->charClass, 0, &info)) == NULL){
+                fprintf(stderr, "No closing quote on row\n");
                 return EXIT_FAILURE;
             }
+            if(info.cells > width) width = info.cells;
         }
+        break;
+    }
+    //every row is edited as a table of its own
+    if(resolveSelections(cmds, cmdCount, 1, width)) return EXIT_FAILURE;
+    program_t prog;
+    if(compileCommands(cmds, cmdCount, &prog)) return EXIT_FAILURE;
+    if(add_row(table)){
+        freeProgram(&prog);
+        fprintf(stderr, "Memory allocation failure\n");
+        return EXIT_FAILURE;
+    }
+    char* tmpPath = NULL;
+    FILE* file = openReplacement(fileName, &tmpPath);
+    outBuf_t out = {file != NULL ? fileno(file) : -1, malloc(OUT_BUF_SIZE), 0, OUT_BUF_SIZE};
+    if(file == NULL || out.buf == NULL){
+        if(file != NULL){
+            fclose(file);
+            unlink(tmpPath);
+            free(tmpPath);
+        }
+        free(out.buf);
+        freeProgram(&prog);
+        fprintf(stderr, "Error while writing file\n");
+        return EXIT_FAILURE;
     }
-    return EXIT_SUCCESS;
-}
 
-//increments the temporary variable var, if it isn't a number, set it to 1
-void inc(table_t* table, int var){
-    if(table->vars[var]->isNum) table->vars[var]->num++;
-    else{
-        table->vars[var]->isNum = true;
-        table->vars[var]->num = 1;
+    parseBuf_t buf = {NULL, 0, 0};
+    row_t* row = ROW_SLOT(0);
+    //the widest written row, and if all rows are as wide
+    int widest = 0;
+    bool even = true;
+    int err = PARSE_OK;
+    for(const char* p = data; p < end && err == PARSE_OK;){
+        freeCells(row, 0, row->len);
+        closeCells(row, 0, row->len);
+        row->tail = NULL;
+        if((p = parseRow(p, end, row, table->charClass, &buf, &err, table->keepCols, table->delim[0])) == NULL){
+            fprintf(stderr, err == PARSE_QUOTE ? "No closing quote on row\n" : "Error while saving table to memory\n");
+            break;
+        }
+        table->width = row->len;
+        selection_t init = {1, 1, 1, 1};
+        table->selection = init;
+        //cut off the empty cells at the end, at least one cell stays
+        int full = 0;
+        if(runProgram(table, &prog) || (full = rowLastFull(row)) < 0 ||
+            (row->len > (full > 0 ? full : 1) && dcol(table, (full > 0 ? full : 1) + 1, row->len))){
+            err = PARSE_SYNTAX;
+            break;
+        }
+        if(full < 1) full = 1;
+        if(widest > 0 && full != widest) even = false;
+        if(full > widest) widest = full;
+        if(putRow(&out, row, 0, table->delim, table->charClass) || putBytes(&out, "\n", 1)){
+            fprintf(stderr, "Error while writing file\n");
+            err = PARSE_ALLOC;
+        }
     }
+    free(buf.text);
+    freeProgram(&prog);
+    if(err == PARSE_OK && flushOut(&out)){
+        fprintf(stderr, "Error while writing file\n");
+        err = PARSE_ALLOC;
+    }
+    fclose(file);
+
+    //add the delims of the rows shorter than the widest one
+    if(err == PARSE_OK && !even){
+        char* padPath = NULL;
+        size_t written;
+        char* text = mapFile(tmpPath, &written);
+        FILE* padFile = text != NULL ? openReplacement(fileName, &padPath) : NULL;
+        if(padFile != NULL){
+            out.fd = fileno(padFile);
+            out.len = 0;
+            if(padLines(table, text, written, widest, &out) || flushOut(&out)) err = PARSE_ALLOC;
+            fclose(padFile);
+        }
+        else err = PARSE_ALLOC;
+        if(text != NULL) munmap(text, written);
+        unlink(tmpPath);
+        free(tmpPath);
+        tmpPath = padPath;
+        if(err != PARSE_OK) fprintf(stderr, "Error while writing file\n");
+    }
+    free(out.buf);
+    if(tmpPath == NULL) return EXIT_FAILURE;
+    //the input isn't read anymore, so it can be written in place
+    if(err != PARSE_OK) unlink(tmpPath);
+    else if(replaceFile(tmpPath, fileName)){
+        fprintf(stderr, "Error while writing file\n");
+        err = PARSE_ALLOC;
+    }
+    free(tmpPath);
+    return err != PARSE_OK ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
-//do all the saved commands in sequence
+//compiles and runs all the saved commands
 int doCommands(table_t* table, command_t* commands, int cmdCount){
-    for(int i = 0; i < cmdCount; i++){
-        if(i < 0) return EXIT_FAILURE;
-        switch(commands[i].name){
-            selection_t select;
-            case SELECTION:
-                table->selection = commands[i].selection;
-                break;
-            case SELECTION_FIND:
-                select = find(commands[i], table);
-                if(select.C1 != 0) table->selection = select;
-                break;
-            case SELECTION_MAX:
-                select = minMax(table, false);
-                if(select.C1 != 0) table->selection = select;
-                break;
-            case SELECTION_MIN:
-                select = minMax(table, true);
-                if(select.C1 != 0) table->selection = select;
-                break;
-            case SET_TEMP:
-                table->tmpSelection = table->selection;
-                break;
-            case SELECTION_RESTORE:
-                table->selection = table->tmpSelection;
-                break;
-            case IROW:
-                if(insert_row(table, table->selection.R1 - 1))
-                    return EXIT_FAILURE;
-                break;
-            case AROW:
-                if(insert_row(table, table->selection.R2))
-                    return EXIT_FAILURE;
-                break;
-            case DROW:
-                if(drow(table, table->selection.R1, table->selection.R2))
-                    return EXIT_FAILURE;
-                break;
-            case DCOL:
-                if(dcol(table, table->selection.C1, table->selection.C2))
-                    return EXIT_FAILURE;
-                break;
-            case ICOL:
-                if(insert_col(table, table->selection.C1 - 1))
-                    return EXIT_FAILURE;
-                break;
-            case ACOL:
-                if(insert_col(table, table->selection.C2))
-                    return EXIT_FAILURE;
-                break;
-            case SET_STR:
-                if(setStr(table, commands[i].str, table->selection))
-                    return EXIT_FAILURE;
-                break;
-            case CLEAR:
-                if(setStr(table, "", table->selection))
-                    return EXIT_FAILURE;
-                break;
-            case SWAP:
-                if(swap(table, commands[i].selection))
-                    return EXIT_FAILURE;
-                break;
-            case SUM:
-                if(sumAvg(table, commands[i].selection, false))
-                    return EXIT_FAILURE;
-                break;
-            case AVG:
-                if(sumAvg(table, commands[i].selection, true))
-                    return EXIT_FAILURE;
-                break;
-            case COUNT:
-                if(count(table, commands[i].selection))
-                    return EXIT_FAILURE;
-                break;
-            case LEN:
-                if(len(table, commands[i].selection))
-                    return EXIT_FAILURE;
-                break;
-            case DEF_TEMP:
-                if(def(table, commands[i].var))
-                    return EXIT_FAILURE;
-                break;
-            case USE_TEMP:
-                if(use(table, commands[i].var))
-                    return EXIT_FAILURE;
-                break;
-            case INC_TEMP:
-                inc(table, commands[i].var);
-                break;
-            case GOTO:
-                i += commands[i].var;
-                break;
-            case ISZERO:
-                if(table->vars[commands[i].var]->num == 0)
-                    i += commands[i].var2;
+    program_t prog;
+    if(compileCommands(commands, cmdCount, &prog)) return EXIT_FAILURE;
+    int err = runProgram(table, &prog);
+    freeProgram(&prog);
+    return err;
+}
+
+//moves the mapped input of the table into a deleted copy of it in TMPDIR,
+//so the rows pointing into it stay valid when the file is written in place,
+//the copy is on disk, so it doesn't count against the memory of the table
+int detachSource(table_t* table){
+    char path[PATH_SIZE];
+    char* dir = getenv("TMPDIR");
+    snprintf(path, PATH_SIZE, "%s/sps-source-XXXXXX", dir != NULL && dir[0] ? dir : "/tmp");
+    int fd = mkstemp(path);
+    if(fd < 0) return EXIT_FAILURE;
+    unlink(path);
+    //writeAll takes an int, so big inputs are written in parts
+    int err = EXIT_SUCCESS;
+    for(size_t done = 0; done < table->sourceLen && !err; done += OUT_BUF_SIZE){
+        size_t len = table->sourceLen - done;
+        err = writeAll(fd, table->source + done, len < OUT_BUF_SIZE ? len : OUT_BUF_SIZE);
+    }
+    //the new mapping takes the place of the old one, so nothing moves
+    void* copy = MAP_FAILED;
+    if(!err) copy = mmap(table->source, table->sourceLen, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0);
+    close(fd);
+    return copy == MAP_FAILED ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+//saves the table in file, when rows are still read from a file, an existing
+//one is replaced by a new file, so it can't be the one they are read from,
+//keep is true if the table is used after it is saved
+int saveTable(table_t* table, const char* fileName, bool snapshot, bool keep){
+    char* tmpPath = NULL;
+    FILE* file = table->source != NULL && !access(fileName, F_OK) ?
+        openReplacement(fileName, &tmpPath) : fopen(fileName, "w");
+    if(file == NULL){
+        fprintf(stderr, "Error while reading file\n");
+        return EXIT_FAILURE;
+    }
+    int err = printTable(table, file);
+    if(fclose(file)) err = EXIT_FAILURE;
+    if(tmpPath != NULL){
+        //a file written in place can't stay mapped under rows that are read
+        //again, the snapshot reads them too
+        if(err || ((keep || snapshot) && savedInPlace(tmpPath, fileName) && detachSource(table))){
+            if(!err) fprintf(stderr, "Error while writing file\n");
+            unlink(tmpPath);
+            err = EXIT_FAILURE;
+        }
+        else if(replaceFile(tmpPath, fileName)){
+            fprintf(stderr, "Error while writing file\n");
+            err = EXIT_FAILURE;
+        }
+        free(tmpPath);
+    }
+    if(!err && snapshot) writeSnapshot(table, fileName);
+    return err;
+}
+
+//checks if the commands only read the table, so they can be run as a query
+bool readOnly(command_t* cmds, int cmdCount){
+    for(int k = 0; k < cmdCount; k++){
+        switch(cmds[k].name){
+            case SELECTION: case SELECTION_MAX: case SELECTION_MIN: case SELECTION_FIND:
+            case SELECTION_RESTORE: case SELECTION_LOOKUP: case SET_TEMP: case SUM:
+            case AVG: case COUNT: case LEN: case DEF_TEMP: case INC_TEMP: case GOTO:
+            case ISZERO: case SUB: case FOREACH_ROWS: case FOREACH_CELLS: case END_EACH:
                 break;
-            case SUB:
-                table->vars[commands[i].var]->isNum = true;
-                table->vars[commands[i].var2]->isNum = true;
-                table->vars[commands[i].var]->num -= table->vars[commands[i].var2]->num;
+            default:
+                return false;
+        }
+    }
+    return true;
+}
+
+//set by SIGINT and SIGTERM to save the table and stop the server
+volatile sig_atomic_t stopServer = 0;
+
+void stopHandler(int sig){
+    (void)sig;
+    stopServer = 1;
+}
+
+//runs one command sequence sent to the server as if sps was started with it,
+//queries write their results to reply, other commands mark the table dirty
+int runRequest(table_t* table, char* line, outBuf_t* reply, bool* dirty){
+    bool query = line[0] == '?';
+    int cmdCount;
+    command_t* cmds;
+    if(parseCommands(query ? line + 1 : line, &cmds, &cmdCount)) return EXIT_FAILURE;
+    if(query && !readOnly(cmds, cmdCount)){
+        fprintf(stderr, "Query can't change the table\n");
+        freeCmds(cmds, cmdCount);
+        return EXIT_FAILURE;
+    }
+    //every sequence starts with the first cell selected and empty variables
+    selection_t init = {1,1,1,1};
+    table->selection = init;
+    table->tmpSelection = init;
+    for(int i = 0; i < 10; i++){
+        table->vars[i]->isNum = false;
+        table->vars[i]->num = 1;
+        table->vars[i]->text[0] = 0;
+    }
+    if(balanceTable(table) || resolveSelections(cmds, cmdCount, table->len, tableWidth(table))){
+        freeCmds(cmds, cmdCount);
+        return EXIT_FAILURE;
+    }
+    table->reply = query ? reply : NULL;
+    int err = doCommands(table, cmds, cmdCount);
+    table->reply = NULL;
+    freeCmds(cmds, cmdCount);
+    if(query){
+        char outStr[4 * 12 + 8];
+        selection_t sel = table->selection;
+        int len = snprintf(outStr, sizeof(outStr), "[%d,%d,%d,%d]\n", sel.R1, sel.C1, sel.R2, sel.C2);
+        return err || putBytes(reply, outStr, len);
+    }
+    //commands that failed may have changed the table before
+    *dirty = true;
+    return err || trimTable(table);
+}
+
+//returns the current time in milliseconds
+long long nowMs(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+//opens the listening socket of the server at path
+int openSocket(const char* path){
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr.sun_path)){
+        fprintf(stderr, "Socket path too long\n");
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0){
+        fprintf(stderr, "Error while opening socket\n");
+        return -1;
+    }
+    //a socket left by a server that didn't stop cleanly is replaced, one of
+    //a running server isn't
+    struct stat st;
+    if(!lstat(path, &st) && S_ISSOCK(st.st_mode)){
+        if(!connect(fd, (struct sockaddr*)&addr, sizeof(addr))){
+            fprintf(stderr, "Socket already in use\n");
+            close(fd);
+            return -1;
+        }
+        unlink(path);
+    }
+    if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) || listen(fd, SERVE_CLIENTS)){
+        fprintf(stderr, "Error while opening socket\n");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+//Keeps the table in memory and runs the requests of clients of the socket
+//one at a time, every line of a client is one request. Changes are saved on
+//flush, quit, SIGINT or SIGTERM and flushEvery seconds after they are made.
+int serveTable(table_t* table, options_t* opts, bool snapshot){
+    int listenFd = openSocket(opts->serve);
+    if(listenFd < 0) return EXIT_FAILURE;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stopHandler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    //a client leaving before its reply is written only loses the reply
+    signal(SIGPIPE, SIG_IGN);
+
+    client_t clients[SERVE_CLIENTS];
+    struct pollfd fds[SERVE_CLIENTS + 1];
+    int clientCount = 0;
+    outBuf_t reply = {-1, NULL, 0, 0};
+    bool dirty = false, stop = false;
+    long long deadline = 0;
+    int err = EXIT_SUCCESS;
+    while(!stop && !stopServer){
+        int timeout = -1;
+        if(dirty && opts->flushEvery > 0){
+            long long left = deadline - nowMs();
+            timeout = left < 0 ? 0 : left;
+        }
+        fds[0].fd = listenFd;
+        fds[0].events = POLLIN;
+        for(int k = 0; k < clientCount; k++){
+            fds[k + 1].fd = clients[k].fd;
+            fds[k + 1].events = POLLIN;
+        }
+        if(poll(fds, clientCount + 1, timeout) < 0){
+            if(errno == EINTR) continue;
+            fprintf(stderr, "Error while waiting for clients\n");
+            err = EXIT_FAILURE;
+            break;
+        }
+        //changes are saved once in a while, a failed save is tried again later
+        if(dirty && opts->flushEvery > 0 && nowMs() >= deadline){
+            if(!saveTable(table, opts->fileName, snapshot, true)) dirty = false;
+            else deadline = nowMs() + opts->flushEvery * 1000LL;
+        }
+        if(fds[0].revents & POLLIN){
+            int fd = accept(listenFd, NULL, NULL);
+            if(fd >= 0 && clientCount < SERVE_CLIENTS){
+                client_t client = {fd, {NULL, 0, 0}};
+                clients[clientCount++] = client;
+            }
+            else if(fd >= 0) close(fd);
+        }
+        //clients are handled backwards, so the ones that left can be removed
+        for(int k = clientCount - 1; k >= 0; k--){
+            if(!(fds[k + 1].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            client_t* client = &clients[k];
+            char bytes[1 << 16];
+            ssize_t got = read(client->fd, bytes, sizeof(bytes));
+            bool drop = got == 0 || (got < 0 && errno != EINTR) ||
+                (got > 0 && appendToBuf(&client->in, bytes, got)) || client->in.len > REQUEST_MAX;
+            //run every whole line that arrived
+            int done = 0;
+            char* nl;
+            while(!drop && !stop && (nl = memchr(client->in.text + done, '\n', client->in.len - done)) != NULL){
+                char* line = client->in.text + done;
+                done = nl + 1 - client->in.text;
+                *nl = 0;
+                if(nl > line && nl[-1] == '\r') nl[-1] = 0;
+                bool wasDirty = dirty;
+                int rslt;
+                reply.len = 0;
+                if(!strcmp(line, "flush") || !strcmp(line, "quit")){
+                    rslt = dirty ? saveTable(table, opts->fileName, snapshot, true) : EXIT_SUCCESS;
+                    if(!rslt) dirty = false;
+                    stop = !strcmp(line, "quit");
+                }
+                else rslt = runRequest(table, line, &reply, &dirty);
+                if(dirty && !wasDirty) deadline = nowMs() + opts->flushEvery * 1000LL;
+                drop = putBytes(&reply, rslt ? "error\n" : "ok\n", rslt ? 6 : 3) ||
+                    writeAll(client->fd, reply.buf, reply.len);
+            }
+            if(done > 0){
+                memmove(client->in.text, client->in.text + done, client->in.len - done);
+                client->in.len -= done;
+            }
+            if(drop){
+                close(client->fd);
+                free(client->in.text);
+                clients[k] = clients[--clientCount];
+                fds[k + 1] = fds[clientCount + 1];
+            }
+        }
+    }
+
+    if(dirty && saveTable(table, opts->fileName, snapshot, false)) err = EXIT_FAILURE;
+    for(int k = 0; k < clientCount; k++){
+        close(clients[k].fd);
+        free(clients[k].in.text);
+    }
+    free(reply.buf);
+    close(listenFd);
+    unlink(opts->serve);
+    return err;
+}
+
+//frees the scripts of a batch
+void freeBatch(batchJob_t* jobs, int jobCount){
+    for(int i = 0; i < jobCount; i++){
+        free(jobs[i].script);
+        freeCmds(jobs[i].cmds, jobs[i].cmdCount);
+    }
+    free(jobs);
+}
+
+//reads the list of a batch, every line holds a script file and the file its
+//result is saved to separated by a tab, empty lines are skipped, the scripts
+//are parsed right away so none of them runs if one is wrong
+int readBatch(const char* list, batchJob_t** jobs, int* jobCount){
+    FILE* file = fopen(list, "r");
+    if(file == NULL){
+        fprintf(stderr, "Error while reading batch list\n");
+        return EXIT_FAILURE;
+    }
+    *jobs = NULL;
+    *jobCount = 0;
+    int allocLen = 0, lineNum = 0, err = EXIT_SUCCESS;
+    char* line = NULL;
+    size_t lineAlloc = 0;
+    ssize_t lineLen;
+    while(!err && (lineLen = getline(&line, &lineAlloc, file)) >= 0){
+        lineNum++;
+        if(lineLen > 0 && line[lineLen - 1] == '\n') line[--lineLen] = 0;
+        if(lineLen == 0) continue;
+        char* tab = strchr(line, '\t');
+        if(tab == NULL || tab == line || tab[1] == 0){
+            fprintf(stderr, "Invalid batch list on line %d\n", lineNum);
+            err = EXIT_FAILURE;
+            break;
+        }
+        if(*jobCount == allocLen){
+            int newAllocLen = allocLen == 0 ? 16 : allocLen * 2;
+            batchJob_t* newJobs = realloc(*jobs, newAllocLen * sizeof(batchJob_t));
+            if(newJobs == NULL){
+                fprintf(stderr, "Memory allocation failure\n");
+                err = EXIT_FAILURE;
                 break;
+            }
+            *jobs = newJobs;
+            allocLen = newAllocLen;
         }
-        //balance the table after each command so there are no missing collumns
-        if(balanceTable(table)){
+        //both names share one copy of the line
+        batchJob_t job = {strdup(line), NULL, NULL, 0, 0};
+        if(job.script == NULL){
             fprintf(stderr, "Memory allocation failure\n");
-            return EXIT_FAILURE;
+            err = EXIT_FAILURE;
+            break;
+        }
+        job.output = job.script + (tab - line) + 1;
+        job.script[tab - line] = 0;
+        if(loadScript(job.script, &job.cmds, &job.cmdCount)){
+            free(job.script);
+            err = EXIT_FAILURE;
+            break;
         }
+        (*jobs)[(*jobCount)++] = job;
     }
-    return EXIT_SUCCESS;
+    free(line);
+    fclose(file);
+    if(!err && *jobCount == 0){
+        fprintf(stderr, "Batch list empty\n");
+        err = EXIT_FAILURE;
+    }
+    if(err){
+        freeBatch(*jobs, *jobCount);
+        *jobs = NULL;
+        *jobCount = 0;
+    }
+    return err;
+}
+
+//returns how many first collumns the scripts of a batch can use, 0 if one
+//of them can use all
+int batchCollumns(batchJob_t* jobs, int jobCount){
+    int used = 0;
+    for(int i = 0; i < jobCount; i++){
+        int C = usedCollumns(jobs[i].cmds, jobs[i].cmdCount);
+        if(C == 0) return 0;
+        if(C > used) used = C;
+    }
+    return used;
+}
+
+//runs one script of a batch in the process forked for it
+int runBatchJob(table_t* table, batchJob_t* job, const char* threads){
+    //the threads of the pool aren't copied by fork
+    initPool(&table->pool);
+    table->pool.serial = table->pager != NULL;
+    setenv("SPS_THREADS", threads, 1);
+    if((table->pager != NULL && forkPager(table->pager)) ||
+        resolveSelections(job->cmds, job->cmdCount, table->len, tableWidth(table)) ||
+        doCommands(table, job->cmds, job->cmdCount) || trimTable(table)){
+        return EXIT_FAILURE;
+    }
+    return saveTable(table, job->output, false, false);
+}
+
+//Runs the scripts of a batch on copies of the loaded table made by forking
+//this process. The copies share the memory of the table until a script
+//writes it, so each script only pays for the rows it changes. As many
+//scripts run at once as there are threads, each with its share of them.
+int runBatch(table_t* table, batchJob_t* jobs, int jobCount){
+    int parallel = threadCount();
+    if(parallel > jobCount) parallel = jobCount;
+    char threads[16];
+    snprintf(threads, sizeof(threads), "%d", threadCount() / parallel);
+    int running = 0, next = 0, err = EXIT_SUCCESS;
+    while(next < jobCount || running > 0){
+        if(next < jobCount && running < parallel){
+            batchJob_t* job = &jobs[next++];
+            job->pid = fork();
+            if(job->pid == 0) _exit(runBatchJob(table, job, threads));
+            if(job->pid < 0){
+                fprintf(stderr, "Error while starting script %s\n", job->script);
+                job->pid = 0;
+                err = EXIT_FAILURE;
+            }
+            else running++;
+            continue;
+        }
+        int status;
+        pid_t pid = wait(&status);
+        if(pid < 0){
+            if(errno == EINTR) continue;
+            break;
+        }
+        for(int i = 0; i < jobCount; i++){
+            if(jobs[i].pid != pid) continue;
+            if(!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS){
+                fprintf(stderr, "Script %s failed\n", jobs[i].script);
+                err = EXIT_FAILURE;
+            }
+            jobs[i].pid = 0;
+            running--;
+        }
+    }
+    return err;
 }
 
 //program entry point
@@ -1320,12 +5280,28 @@ int main(int argc, char** argv){
     } 
     table.len = 0; table.rows = NULL;
     table.allocLen = 0;
+    table.gapStart = 0;
+    table.ragged = true;
+    table.width = 0;
+    table.columns = NULL;
+    table.columnsLen = 0;
+    table.findIndex = NULL;
+    table.finds = 0;
+    table.lookups = NULL;
+    table.lookupsLen = 0;
+    table.pager = NULL;
+    table.keepCols = 0;
+    table.source = NULL;
+    table.snap = NULL;
+    table.snapCells = NULL;
+    table.reply = NULL;
+    initPool(&table.pool);
     selection_t init = {1,1,1,1};
     table.selection = init;
     table.tmpSelection = init;
-    char *fileName = NULL, *commands = NULL;
+    options_t opts = {NULL, NULL, NULL, 0, false, false, NULL, 0, NULL};
     //save and check arguments
-    if(getArgs(args, &table.delim, &fileName, &commands)){
+    if(getArgs(args, &table.delim, &opts)){
         return EXIT_FAILURE;
     }
     //check delim for quotes or backslashes
@@ -1334,44 +5310,71 @@ int main(int argc, char** argv){
         freeTable(&table);
         return EXIT_FAILURE;
     }
-    //open, read and save file contents into table
-    FILE* file = fopen(fileName, "r");
-    if(file == NULL){
-        fprintf(stderr, "Error while reading file\n");
+    buildCharClass(&table);
+    //read and save all commands, they are parsed first to find the collumns
+    //they can use, the server gets them later and a batch from its list
+    int cmdCount = 0;
+    command_t* cmds = NULL;
+    if(opts.serve == NULL && opts.batch == NULL && (opts.script != NULL ? loadScript(opts.script, &cmds, &cmdCount) :
+        parseCommands(opts.commands, &cmds, &cmdCount))){
         freeTable(&table);
         return EXIT_FAILURE;
     }
-    if(readFile(file, table.delim, &table) || balanceTable(&table)){
-        fclose(file);
+    int jobCount = 0;
+    batchJob_t* jobs = NULL;
+    if(opts.batch != NULL && readBatch(opts.batch, &jobs, &jobCount)){
         freeTable(&table);
         return EXIT_FAILURE;
     }
-    fclose(file);
-    //read and save all commands
-    int cmdCount;
-    command_t* cmds = parseCommands(commands, &table, &cmdCount);
-    if(cmds == NULL){
+    table.keepCols = opts.serve != NULL ? 0 :
+        opts.batch != NULL ? batchCollumns(jobs, jobCount) : usedCollumns(cmds, cmdCount);
+    //commands editing every row on its own don't need the whole table
+    if(opts.serve == NULL && opts.batch == NULL && rowLocal(cmds, cmdCount)){
+        int err = streamFile(&table, opts.fileName, cmds, cmdCount);
+        freeTable(&table);
+        freeCmds(cmds, cmdCount);
+        return err;
+    }
+    //with a memory limit or --lazy, rows stay in files until they are used
+    if((opts.memLimit > 0 || opts.lazy) &&
+        initPager(&table, opts.memLimit > 0 ? opts.memLimit : SIZE_MAX, opts.lazy)){
         freeTable(&table);
+        freeCmds(cmds, cmdCount);
+        freeBatch(jobs, jobCount);
         return EXIT_FAILURE;
     }
-    //execute all commands and trim excess collumns
-    if(doCommands(&table, cmds, cmdCount) || trimTable(&table)){
+    //read and save file contents into table, an up to date snapshot of a table
+    //kept in memory is loaded instead
+    bool snapshot = opts.snapshot && table.pager == NULL;
+    if((!(snapshot && !loadSnapshot(&table, opts.fileName)) && readFile(opts.fileName, &table)) ||
+        balanceTable(&table) ||
+        resolveSelections(cmds, cmdCount, table.len, tableWidth(&table))){
         freeTable(&table);
         freeCmds(cmds, cmdCount);
+        freeBatch(jobs, jobCount);
         return EXIT_FAILURE;
     }
-    //save the edited table in file
-    file = fopen(fileName, "w");
-    if(file == NULL){
-        fprintf(stderr, "Error while reading file\n");
+    if(opts.batch != NULL){
+        int err = runBatch(&table, jobs, jobCount);
+        freeTable(&table);
+        freeBatch(jobs, jobCount);
+        return err;
+    }
+    if(opts.serve != NULL){
+        int err = serveTable(&table, &opts, snapshot);
+        freeTable(&table);
+        return err;
+    }
+    //execute all commands and trim excess collumns
+    if(doCommands(&table, cmds, cmdCount) || trimTable(&table)){
         freeTable(&table);
         freeCmds(cmds, cmdCount);
         return EXIT_FAILURE;
     }
-    printTable(&table, file);
+    //save the edited table in file
+    int err = saveTable(&table, opts.fileName, snapshot, false);
     //free everything and exit
     freeTable(&table);
     freeCmds(cmds, cmdCount);
-    fclose(file);
-    return EXIT_SUCCESS;
+    return err;
 }
\ No newline at end of file